@@ -0,0 +1,250 @@
+/*
+ * Client for the polyline server, see serve.h.
+ *
+ * Reads one polyline, or one list of coordinates, per line from stdin
+ * and prints the results like the polyline utility does. Requests are
+ * pipelined in batches of up to `batch_lines` lines or `batch_bytes`.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "polyline.h"
+#include "serve.h"
+
+#define eprintf(...) fprintf(stderr, __VA_ARGS__)
+
+static const int batch_lines = 128;
+/* Stay below socket buffer sizes, so neither side blocks on a full one. */
+static const size_t batch_bytes = 64 * 1024;
+static char *program = NULL;
+
+static int
+_write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	while (len) {
+		ssize_t r = write(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int
+_read_all(int fd, void *data, size_t len)
+{
+	char *p = data;
+	while (len) {
+		ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ * Parse floats separated by whitespace, commas or brackets.
+ */
+static size_t
+_parse_floats(float **rptr, size_t *rsize, char *line)
+{
+	size_t n = 0;
+	char *endptr;
+
+	for (char *p = line; *p; ) {
+		if (strchr(" \t[](){},", *p)) {
+			p++;
+			continue;
+		}
+		float f = strtof(p, &endptr);
+		if (endptr == p)
+			break;
+		if (n >= *rsize) {
+			size_t new_size = *rsize ? *rsize * 2 : 64;
+			float *fptr = realloc(*rptr, new_size * sizeof(float));
+			if (!fptr)
+				break;
+			*rptr = fptr;
+			*rsize = new_size;
+		}
+		(*rptr)[n++] = f;
+		p = endptr;
+	}
+	return n;
+}
+
+/*
+ * Build the request for one input line. Encode payloads are kept in
+ * `floats`, decode payloads point into `line`.
+ */
+static const void *
+_request(struct serve_frame *req, int encode, char *line, float **floats,
+	 size_t *floats_size)
+{
+	req->code = encode ? SERVE_OP_ENCODE : SERVE_OP_DECODE;
+	if (encode) {
+		req->length = _parse_floats(floats, floats_size, line) * sizeof(float);
+		return *floats;
+	}
+	req->length = strlen(line);
+	return line;
+}
+
+static int
+_print_response(int fd, int encode, int precision, char **buf, size_t *buf_size)
+{
+	struct serve_frame resp;
+
+	if (_read_all(fd, &resp, sizeof(resp)) || resp.length > SERVE_MAX_FRAME)
+		return -1;
+	if (resp.length > *buf_size) {
+		char *p = realloc(*buf, resp.length);
+		if (!p)
+			return -1;
+		*buf = p;
+		*buf_size = resp.length;
+	}
+	if (_read_all(fd, *buf, resp.length))
+		return -1;
+
+	if (resp.code < 0) {
+		eprintf("Failed to %s - %s (%d)\n", encode ? "encode" : "decode",
+			polyline_strerror(resp.code), resp.code);
+		if (encode)
+			printf("\n"); /* Empty line on errors */
+		return 0;
+	}
+	if (encode) {
+		printf("%.*s\n", (int)resp.length, *buf);
+		return 0;
+	}
+
+	const float *coords = (const float *)*buf;
+	printf("[");
+	for (int i = 0; i < resp.code; i++) {
+		printf("[%.*f, %.*f]%s",
+		       precision, coords[i * 2],
+		       precision, coords[i * 2 + 1],
+		       (i < (resp.code - 1)) ? ", " : "");
+	}
+	printf("]\n");
+	return 0;
+}
+
+static void
+usage()
+{
+	eprintf("Usage: %s [-h|-d|-e] [-p precision] SOCKET\n\n", program);
+	eprintf("Options:\n");
+	eprintf("  -h             Display this help message.\n");
+	eprintf("  -d [default]   Decode polylines.\n");
+	eprintf("  -e             Encode coordinates and output polylines.\n");
+	eprintf("  -p [default 5] Output precision when decoding. 0 to 10.\n");
+	eprintf("\n"
+		"Input is read from stdin, one request per line, and sent to\n"
+		"a server started with 'polyline --serve SOCKET'.\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	program = argv[0];
+	int opt, encode = 0, precision = 5, fd, r = 0;
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	char *endptr;
+
+	while ((opt = getopt(argc, argv, "dehp:")) >= 0) {
+		switch (opt) {
+		case 'e':
+			encode = 1;
+			break;
+		case 'd':
+			encode = 0;
+			break;
+		case 'p':
+			precision = strtol(optarg, &endptr, 10);
+			if (*endptr || precision < 0 || precision > 10) {
+				eprintf("%s: invalid precision -- '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		case '?': /* Unknown option */
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+	if (strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+		eprintf("%s: socket path too long\n", program);
+		return 1;
+	}
+	strcpy(addr.sun_path, argv[optind]);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		eprintf("%s: %s: %s\n", program, argv[optind], strerror(errno));
+		return 1;
+	}
+
+	char *lineptr = NULL, *buf = NULL;
+	size_t n = 0, buf_size = 0, floats_size = 0, inflight_bytes = 0;
+	float *floats = NULL;
+	ssize_t len;
+	int inflight = 0;
+
+	while (!r) {
+		struct serve_frame req;
+		const void *payload = NULL;
+
+		if ((len = getline(&lineptr, &n, stdin)) > 0) {
+			if (lineptr[len - 1] == '\n')
+				lineptr[len - 1] = '\0';
+			payload = _request(&req, encode, lineptr, &floats, &floats_size);
+		}
+		/* Collect responses for a full batch, or at the end. */
+		if (len < 0 || inflight == batch_lines ||
+		    (inflight && inflight_bytes + sizeof(req) + req.length > batch_bytes)) {
+			for (; !r && inflight > 0; inflight--)
+				r = _print_response(fd, encode, precision, &buf, &buf_size);
+			inflight_bytes = 0;
+		}
+		if (len < 0)
+			break;
+		if (!r && payload) {
+			r = _write_all(fd, &req, sizeof(req)) ||
+			    _write_all(fd, payload, req.length);
+			inflight++;
+			inflight_bytes += sizeof(req) + req.length;
+		}
+	}
+	if (r)
+		eprintf("%s: connection failed\n", program);
+
+	fflush(stdout);
+	close(fd);
+	free(lineptr);
+	free(buf);
+	free(floats);
+	return r ? 1 : 0;
+}
@@ -3,34 +3,261 @@
  */
 #include <assert.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "polyline.h"
+#include "polyline_cache.h"
+#include "serve.h"
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
 static char* program = NULL;
 
 
+/*
+ * Statistics for --stats. Stage durations go into log-linear histograms:
+ * 16 buckets per power of two, so percentiles are within about 6%.
+ */
+enum stage {
+	STAGE_READ,
+	STAGE_PARSE,
+	STAGE_CODEC,
+	STAGE_FORMAT,
+	STAGE_WRITE,
+	STAGE_LINE,             /* all of the above for one line */
+	STAGES,
+};
+
+static const char *stage_names[STAGES] = {
+	"read", "parse", "codec", "format", "write", "line",
+};
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (HIST_SUB + (64 - 4) * HIST_SUB)
+#define MAX_ERRORS 8
+
+struct hist {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct stats {
+	int enabled;
+	uint64_t lines;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t coords;
+	uint64_t alloc_calls;           /* calls that allocated or grew a buffer */
+	uint64_t errors[MAX_ERRORS];     /* by -POLYLINE_E* */
+	uint64_t odd_floats;            /* -e lines with an odd number of floats */
+	struct hist stages[STAGES];
+};
+
+static struct stats stats;
+
+static uint64_t
+stats_clock(void)
+{
+	struct timespec ts;
+	if (!stats.enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+hist_bucket(uint64_t ns)
+{
+	if (ns < HIST_SUB)
+		return ns;
+	int k = 63 - __builtin_clzll(ns);
+	return HIST_SUB + (k - 4) * HIST_SUB + ((ns >> (k - 4)) & (HIST_SUB - 1));
+}
+
+/* Middle of the values falling into bucket `b`. */
+static double
+hist_value(int b)
+{
+	if (b < HIST_SUB)
+		return b;
+	int k = (b - HIST_SUB) / HIST_SUB + 4;
+	uint64_t low = (uint64_t)(HIST_SUB + (b - HIST_SUB) % HIST_SUB) << (k - 4);
+	return low + (double)(1ULL << (k - 4)) / 2;
+}
+
+static double
+hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank = h->count * p, seen = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > rank)
+			return hist_value(b) < h->max ? hist_value(b) : h->max;
+	}
+	return h->max;
+}
+
+/*
+ * Account the time since `start` to `stage`. Returns the current time,
+ * which starts the next stage.
+ */
+static uint64_t
+stats_stage(enum stage stage, uint64_t start)
+{
+	if (!stats.enabled)
+		return 0;
+	uint64_t now = stats_clock(), ns = now - start;
+	struct hist *h = &stats.stages[stage];
+	h->count++;
+	h->total += ns;
+	h->max = ns > h->max ? ns : h->max;
+	h->buckets[hist_bucket(ns)]++;
+	return now;
+}
+
+static void
+stats_error(int r)
+{
+	if (-r > 0 && -r < MAX_ERRORS)
+		stats.errors[-r]++;
+}
+
+static size_t
+stats_write(const void *data, size_t len)
+{
+	stats.bytes_out += len;
+	return fwrite(data, 1, len, stdout);
+}
+
+static void
+stats_print(uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+
+	eprintf("stats: lines=%" PRIu64 " bytes_in=%" PRIu64 " bytes_out=%" PRIu64
+		" coords=%" PRIu64 " alloc_calls=%" PRIu64 "\n",
+		stats.lines, stats.bytes_in, stats.bytes_out, stats.coords,
+		stats.alloc_calls);
+	uint64_t errors = stats.odd_floats;
+	eprintf("stats: errors");
+	for (int i = 1; i < MAX_ERRORS; i++) {
+		if (stats.errors[i])
+			eprintf(" %s=%" PRIu64, polyline_strerror(-i), stats.errors[i]);
+		errors += stats.errors[i];
+	}
+	if (stats.odd_floats)
+		eprintf(" odd_floats=%" PRIu64, stats.odd_floats);
+	eprintf("%s\n", errors ? "" : " none");
+	eprintf("stats: elapsed=%.3fs lines/s=%.0f MB/s in=%.2f out=%.2f coords/s=%.0f\n",
+		secs, stats.lines / secs, stats.bytes_in / secs / 1e6,
+		stats.bytes_out / secs / 1e6, stats.coords / secs);
+	eprintf("stats: %-8s %10s %6s %9s %9s %9s %9s\n",
+		"stage", "total_ms", "share", "p50_us", "p90_us", "p99_us", "max_us");
+	for (int i = 0; i < STAGES; i++) {
+		const struct hist *h = &stats.stages[i];
+		if (!h->count)
+			continue;
+		eprintf("stats: %-8s %10.3f %5.1f%% %9.3f %9.3f %9.3f %9.3f\n",
+			stage_names[i], h->total / 1e6,
+			elapsed ? 100.0 * h->total / elapsed : 0,
+			hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+			hist_percentile(h, 0.99) / 1e3, h->max / 1e3);
+	}
+}
+
+
+/* Reusable buffer for formatting one output line. */
+struct line {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static int
+line_printf(struct line *l, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(l->data + l->len, l->size - l->len, fmt, ap);
+	va_end(ap);
+	if (r < 0)
+		return r;
+	if (l->len + r >= l->size) {
+		size_t new_size = (l->len + r + 1) * 2;
+		char *data = realloc(l->data, new_size);
+		if (!data)
+			return -1;
+		l->data = data;
+		l->size = new_size;
+		stats.alloc_calls++;
+		va_start(ap, fmt);
+		r = vsnprintf(l->data + l->len, l->size - l->len, fmt, ap);
+		va_end(ap);
+	}
+	l->len += r;
+	return r;
+}
+
 static void
-decode_line(float **dst, size_t *size, const char *line, int precision) {
+decode_line(float **dst, size_t *size, const char *line, int precision,
+	    struct polyline_cache *cache)
+{
+	static struct line out;
+	const float *coords;
+	const char *cached = NULL;
+	size_t cached_len = 0, old_size = *size;
+	uint64_t t = stats_clock();
 	int r;
-	if ((r = polyline_decode(dst, size, line)) < 0) {
+
+	if (cache)
+		r = polyline_cache_decode(cache, line, &coords, &cached, &cached_len);
+	else
+		r = polyline_decode(dst, size, line);
+	t = stats_stage(STAGE_CODEC, t);
+	stats.alloc_calls += *size != old_size;
+	if (r < 0) {
 		eprintf("Failed to decode '%s' - %s (%d)\n",
 			line, polyline_strerror(r), r);
+		stats_error(r);
+		return;
+	}
+	stats.coords += r;
+	if (cached) {
+		stats_write(cached, cached_len);
+		stats_stage(STAGE_WRITE, t);
 		return;
 	}
+	if (!cache)
+		coords = *dst;
 
-	printf("[");
+	out.len = 0;
+	line_printf(&out, "[");
 	for (int i = 0; i < r; i++) {
-		printf("[%.*f, %.*f]%s",
-		       precision, (*dst)[i * 2],
-		       precision, (*dst)[i * 2 + 1],
-		       (i < (r - 1)) ? ", " : ""
+		line_printf(&out, "[%.*f, %.*f]%s",
+			    precision, coords[i * 2],
+			    precision, coords[i * 2 + 1],
+			    (i < (r - 1)) ? ", " : ""
 		);
 	}
-	printf("]\n");
+	if (line_printf(&out, "]\n") < 0) {
+		eprintf("%s: out of memory!\n", program);
+		return;
+	}
+	t = stats_stage(STAGE_FORMAT, t);
+	stats_write(out.data, out.len);
+	stats_stage(STAGE_WRITE, t);
+	if (cache)
+		polyline_cache_set_extra(cache, line, out.data, out.len);
 }
 
 /* Replace these input characters with spaces when encoding. */
@@ -64,6 +291,8 @@ encode_line(char **dst, size_t *size, char *line) {
 	int i, r, floats = 0, in_space = 1;
 	char *ptr = line, *endptr;
 	float *latlngs;
+	size_t old_size = *size;
+	uint64_t t = stats_clock();
 
 	/*
 	 * Replace characters. '[(1.0, 2.0)]'ends up as '  1.0  2.0  '
@@ -86,7 +315,8 @@ encode_line(char **dst, size_t *size, char *line) {
 
 	if (floats & 1) {
 		eprintf("odd number of floats in line: %d", floats);
-		printf("\n");
+		stats.odd_floats++;
+		stats_write("\n", 1);
 		return 0;
 	}
 	latlngs = malloc(floats * sizeof(float));
@@ -94,6 +324,7 @@ encode_line(char **dst, size_t *size, char *line) {
 		eprintf("%s: out of memory!", program);
 		return -1;
 	}
+	stats.alloc_calls++;
 
 	/* Reset to the beginning. */
 	ptr = line;
@@ -102,21 +333,31 @@ encode_line(char **dst, size_t *size, char *line) {
 		r = _strtof(&latlngs[i], ptr, &endptr);
 		if (r < 0) {
 			eprintf("invalid decimal number starting at: '%s'\n", endptr);
-			printf("\n"); /* empty line */
+			stats_error(POLYLINE_EPARSE);
+			stats_write("\n", 1); /* empty line */
 			goto err;
 		}
 		ptr = endptr;
 		i++;
 	}
 	assert(floats == i);
+	t = stats_stage(STAGE_PARSE, t);
 
-	if ((r = polyline_encode(dst, size, latlngs, i / 2)) < 0) {
+	r = polyline_encode(dst, size, latlngs, i / 2);
+	t = stats_stage(STAGE_CODEC, t);
+	stats.alloc_calls += *size != old_size;
+	if (r < 0) {
 		eprintf("Failed to encode '%s' - %s (%d)\n",
 			line, polyline_strerror(r), r);
-		printf("\n"); /* Empty line on errors */
+		stats_error(r);
+		stats_write("\n", 1); /* Empty line on errors */
 		goto err;
 	}
-	printf("%s\n", *dst);
+	stats.coords += i / 2;
+	(*dst)[r] = '\n';
+	stats_write(*dst, r + 1);
+	(*dst)[r] = '\0';
+	stats_stage(STAGE_WRITE, t);
 err:
 	free(latlngs);
 	return 0;
@@ -125,31 +366,55 @@ err:
 static void
 usage()
 {
-	eprintf("Usage: %s [-h|-d|-e] [polyline]\n\n", program);
+	eprintf("Usage: %s [-h|-d|-e] [-p precision] [--cache N] [--stats] [--serve SOCKET] [polyline]\n\n", program);
 	eprintf("Options:\n");
 	eprintf("  -h             Display this help message.\n");
 	eprintf("  -d [default]   Decode a polyline.\n");
 	eprintf("  -e             Encode coordinates and output a polyline.\n");
 	eprintf("  -p [default 5] Output precision when decoding. 0 to 10.\n");
+	eprintf("  --cache N      Cache the last N decoded polylines and their\n"
+		"                 output. Statistics are reported on stderr.\n");
+	eprintf("  --stats        Report counters and the time spent in each\n"
+		"                 stage on stderr at exit.\n");
+	eprintf("  --serve SOCKET Serve encode and decode requests on a Unix\n"
+		"                 domain socket, see polyline-client. Takes\n"
+		"                 no other options or polyline.\n");
 	eprintf("\n"
 	        "If no argument is provided following the options input\n"
 		"will be read from stdin.\n");
 }
 
 
+enum {
+	OPT_CACHE = 256,
+	OPT_SERVE,
+	OPT_STATS,
+};
+
+static const struct option long_options[] = {
+	{"cache", required_argument, NULL, OPT_CACHE},
+	{"serve", required_argument, NULL, OPT_SERVE},
+	{"stats", no_argument, NULL, OPT_STATS},
+	{NULL, 0, NULL, 0},
+};
+
+
 int
 main(int argc, char *argv[])
 {
 	program = argv[0];
 	int opt, encode = 0, decode = 0;
-	int precision = 5;
+	int precision = 5, precision_set = 0;
+	long cache_size = 0;
 	char *endptr;
+	struct polyline_cache *cache = NULL;
+	const char *serve_path = NULL;
 
 	void *dst = NULL;
 	size_t dst_size = 0;
 
 	opterr = 1;
-	while ((opt = getopt(argc, argv, "dehp:")) >= 0) {
+	while ((opt = getopt_long(argc, argv, "dehp:", long_options, NULL)) >= 0) {
 		switch(opt) {
 		case 'e':
 			encode = 1;
@@ -164,6 +429,21 @@ main(int argc, char *argv[])
 					argv[0], optarg);
 				return 1;
 			}
+			precision_set = 1;
+			break;
+		case OPT_CACHE:
+			cache_size = strtol(optarg, &endptr, 10);
+			if (*endptr || cache_size < 1 || (unsigned long)cache_size > SIZE_MAX / 4) {
+				eprintf("%s: invalid cache size -- '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case OPT_SERVE:
+			serve_path = optarg;
+			break;
+		case OPT_STATS:
+			stats.enabled = 1;
 			break;
 		case 'h':
 			usage();
@@ -176,24 +456,59 @@ main(int argc, char *argv[])
 		eprintf("%s: specifying -e and -d is invalid\n", argv[0]);
 		return 1;
 	}
+	if (encode && cache_size) {
+		eprintf("%s: specifying -e and --cache is invalid\n", argv[0]);
+		return 1;
+	}
+	if (serve_path) {
+		/* Requests carry their own mode and precision. */
+		const char *opt_name = encode ? "-e" : decode ? "-d" :
+			precision_set ? "-p" : cache_size ? "--cache" :
+			stats.enabled ? "--stats" : NULL;
+		if (opt_name) {
+			eprintf("%s: specifying --serve and %s is invalid\n",
+				argv[0], opt_name);
+			return 1;
+		}
+		if (optind < argc) {
+			eprintf("%s: --serve takes no polyline argument\n", argv[0]);
+			return 1;
+		}
+		return serve(serve_path);
+	}
 	/* Default to decode if nothing was set. */
 	decode = (!encode && !decode) || decode;
 
+	if (cache_size && decode && polyline_cache_create(&cache, cache_size)) {
+		eprintf("%s: out of memory!\n", program);
+		return 1;
+	}
+
+	uint64_t start = stats_clock();
 	if (optind == argc) {
 		char *lineptr = NULL;
-		size_t n = 0;
+		size_t n = 0, old_n = 0;
+		uint64_t t = start;
 		int r;
 
 		while ((r = getline(&lineptr, &n, stdin)) >= 0) {
+			uint64_t line_start = t;
+			t = stats_stage(STAGE_READ, t);
+			stats.alloc_calls += n != old_n;
+			old_n = n;
+			stats.lines++;
+			stats.bytes_in += r;
 			if (lineptr[r - 1] == '\n') {
 				lineptr[r - 1] = '\0';
 			}
 
 			if (decode) {
-				decode_line((float **)&dst, &dst_size, lineptr, precision);
+				decode_line((float **)&dst, &dst_size, lineptr, precision, cache);
 			} else {
 				encode_line((char **)&dst, &dst_size, lineptr);
 			}
+			stats_stage(STAGE_LINE, line_start);
+			t = stats_clock();
 		}
 		fflush(stdout);
 		if (lineptr && n > 0)
@@ -203,11 +518,26 @@ main(int argc, char *argv[])
 			eprintf("%s: too many arguments\n", program);
 			return 1;
 		}
+		stats.lines++;
+		stats.bytes_in += strlen(argv[optind]);
 		if (decode) {
-			decode_line((float **)&dst, &dst_size, argv[optind], precision);
+			decode_line((float **)&dst, &dst_size, argv[optind], precision, cache);
 		} else {
 			encode_line((char **)&dst, &dst_size, argv[optind]);
 		}
+		stats_stage(STAGE_LINE, start);
+		fflush(stdout);
+	}
+	if (stats.enabled)
+		stats_print(stats_clock() - start);
+
+	if (cache) {
+		struct polyline_cache_stats stats;
+		polyline_cache_stats(cache, &stats);
+		eprintf("cache: hits=%zu misses=%zu evictions=%zu entries=%zu/%zu\n",
+			stats.hits, stats.misses, stats.evictions,
+			stats.entries, stats.capacity);
+		polyline_cache_destroy(cache);
 	}
 
 	if (dst)
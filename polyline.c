@@ -3,15 +3,22 @@
  */
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "polyline.h"
+#include "polyline_internal.h"
 
 static const float precision = 100000.0f;
 static const int max_5bit_chunks = 6;
+/* Interleaved lat/lng values per block of the SIMD stages, must be even. */
+static const size_t block_values = 512;
 
 /* Internal structure to help keep track of allocated data for the result. */
 struct buf {
@@ -38,13 +45,85 @@ dprint_bits(const uint32_t v) {
 #define dprint_bits(...)
 #endif
 
+/*
+ * Trace points, compiled in with -DPOLYLINE_TRACE only. Each one is a
+ * USDT probe in the "polyline" provider if <sys/sdt.h> is available,
+ * and calls the callback registered with polyline_set_trace().
+ */
+#ifdef POLYLINE_TRACE
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define _probe(name, arg) DTRACE_PROBE1(polyline, name, arg)
+#else
+#define _probe(name, arg)
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define _ticks() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t
+_ticks(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/*
+ * The callback and its context are published as a pair through a
+ * sequence lock: `trace_seq` is odd while polyline_set_trace() changes
+ * them, and readers retry if it changed while they loaded the pair.
+ */
+static polyline_trace_fn trace_fn;
+static void *trace_ctx;
+static unsigned trace_seq;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_trace(int point, uint64_t start, int64_t arg)
+{
+	polyline_trace_fn fn;
+	void *ctx;
+	unsigned seq;
+
+	do {
+		while ((seq = __atomic_load_n(&trace_seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		fn = __atomic_load_n(&trace_fn, __ATOMIC_RELAXED);
+		ctx = __atomic_load_n(&trace_ctx, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&trace_seq, __ATOMIC_RELAXED));
+	if (!fn)
+		return;
+	struct polyline_trace_event ev = {
+		.point = point,
+		.ticks = _ticks(),
+		.arg = arg,
+	};
+	ev.elapsed = start ? ev.ticks - start : 0;
+	fn(&ev, ctx);
+}
+
+#define polyline_trace_clock(var) \
+	uint64_t var = __atomic_load_n(&trace_fn, __ATOMIC_RELAXED) ? _ticks() : 0
+#define polyline_trace(name, point, start, arg) do { \
+	_probe(name, (int64_t)(arg)); \
+	_trace(point, start, arg); \
+} while (0)
+#else
+#define polyline_trace_clock(var)
+#define polyline_trace(...)
+#endif
+
 
 /*
- * Assume every coordinate just causes two bytes to be used. This will
- * allocate less memory, but more often.
+ * Make room for `n` more bytes. Assume every coordinate left just causes
+ * two bytes to be used. This will allocate less memory, but more often.
  */
 static int
-_add_chunks_to_buf(struct buf *buf, uint8_t *chunks, size_t n, size_t coords_left) {
+_reserve_chunks(struct buf *buf, size_t n, size_t coords_left) {
 
 	dprintf("buf: size=%lu idx=%lu data=%p\n",
 		buf->size, buf->idx, buf->data);
@@ -52,6 +131,7 @@ _add_chunks_to_buf(struct buf *buf, uint8_t *chunks, size_t n, size_t coords_lef
 		size_t new_size = buf->size + n + coords_left * 4;
 		dprintf("realloc: coords_left=%lu n=%lu idx=%lu size=%lu new_size=%lu\n",
 			coords_left, n, buf->idx, buf->size, new_size);
+		polyline_trace(grow, POLYLINE_TRACE_GROW, 0, new_size * sizeof(float));
 
 		buf->data = realloc(buf->data, new_size * sizeof(float));
 		if (!buf->data)
@@ -60,6 +140,13 @@ _add_chunks_to_buf(struct buf *buf, uint8_t *chunks, size_t n, size_t coords_lef
 		buf->allocs += 1;
 	}
 	assert(buf->idx + n <= buf->size);
+	return 0;
+}
+
+static int
+_add_chunks_to_buf(struct buf *buf, uint8_t *chunks, size_t n, size_t coords_left) {
+	if (_reserve_chunks(buf, n, coords_left))
+		return POLYLINE_ENOMEM;
 	char *data = (char *)buf->data;
 	memcpy(&data[buf->idx], chunks, n);
 	buf->idx += n;
@@ -68,61 +155,74 @@ _add_chunks_to_buf(struct buf *buf, uint8_t *chunks, size_t n, size_t coords_lef
 
 
 /*
- * Returns number of chunks created for use in copy.
+ * Quantize a single delta and zigzag encode it.
  */
-static int
-_polyline_encode_float(uint8_t *chunks, const float f)
+static inline uint32_t
+_quantize_float(const float f)
 {
 	/*
 	 * 1) and 2) Rounding taken from python-polyline, the description
 	 *           does not mention this explicitly, unfortunately :-/
+	 *
+	 *           Adding 0.5 and truncating is the same as floorf() for
+	 *           positive values, and is what the SIMD kernel does.
 	 */
-	uint32_t val = (uint32_t)(floorf(fabsf(f * precision) + 0.5));
-	int neg = (f < 0.0f);
+	int32_t val = (int32_t)(fabsf(f * precision) + 0.5f);
 
-	/*
-	 * 3) Two's complement for negative numbers
-	 *    XXX: Couldn't we maybe just use a signed integer?
-	 */
-	if (neg) {
-		val = ~val + 1;
-	}
+	/* 3) Two's complement for negative numbers */
+	if (f < 0.0f)
+		val = -val;
 
-	/* 4) Left shift by one bit... */
-	val <<= 1;
+	/* 4) Left shift by one bit and invert if negative. */
+	return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
 
-	/* Invert if original value was negative */
-	if (neg) {
-		val = ~val;
+/*
+ * Encoding stage 1: delta to the previous coordinate, quantization and
+ * zigzag encoding of `count` interleaved lat/lng values starting at
+ * `coords[start]`. The first coordinate is relative to (0, 0).
+ */
+static void
+_encode_deltas(uint32_t *dst, const float *coords, size_t start, size_t count)
+{
+	size_t i = 0;
+	for (; i < count && start + i < 2; i++)
+		dst[i] = _quantize_float(coords[start + i]);
+#ifdef __SSE2__
+	const __m128 p = _mm_set1_ps(precision), half = _mm_set1_ps(0.5f);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	for (; i + 4 <= count; i += 4) {
+		const float *c = &coords[start + i];
+		__m128 d = _mm_sub_ps(_mm_loadu_ps(c), _mm_loadu_ps(c - 2));
+		__m128i neg = _mm_castps_si128(_mm_cmplt_ps(d, _mm_setzero_ps()));
+		__m128 a = _mm_add_ps(_mm_andnot_ps(sign, _mm_mul_ps(d, p)), half);
+		__m128i q = _mm_cvttps_epi32(a);
+		q = _mm_sub_epi32(_mm_xor_si128(q, neg), neg);
+		q = _mm_xor_si128(_mm_slli_epi32(q, 1), _mm_srai_epi32(q, 31));
+		_mm_storeu_si128((__m128i *)&dst[i], q);
 	}
+#endif
+	for (; i < count; i++)
+		dst[i] = _quantize_float(coords[start + i] - coords[start + i - 2]);
+}
 
-	dprintf("%f val=%u val=%#0x neg=%d ", f, val, val, neg);
-	dprint_bits(val);
-
-	int i = 0;
-	do {
-		/* 5 bits from the right */
-		uint8_t chunk = val & 0x1f;
-		val = val >> 5;
-
-		/* 8) More chunks? If so, set 0x20 */
-		chunk |= (val > 0 ? 0x20 : 0x00);
-
-		/* 10) Add 63 */
-		chunk += 63;
-
-		/*
-		dprintf("chunks[%d]: (val=%u) %c ", i, val, chunk);
-		dprint_bits(chunk);
-		*/
-
-		chunks[i++] = chunk;
-
-	} while (i < max_5bit_chunks && val > 0);
-
-	assert(!val);
-
-	return i;
+/*
+ * Encoding stage 2: split values into 5-bit chunks, set 0x20 if more
+ * chunks follow and add 63. `dst` needs room for
+ * `max_5bit_chunks_decode` bytes per value.
+ *
+ * Returns number of bytes written.
+ */
+static size_t
+_encode_chunks(char *dst, const uint32_t *vals, size_t count)
+{
+	char *p = dst;
+	for (size_t i = 0; i < count; i++) {
+		dprintf("val=%u ", vals[i]);
+		dprint_bits(vals[i]);
+		p += _encode_value(p, vals[i]);
+	}
+	return p - dst;
 }
 
 
@@ -133,31 +233,26 @@ polyline_encode(char **rptr, size_t *rsize, const float *coords, size_t n)
 		.data = *rptr,
 		.size = *rsize,
 	};
-	if (!coords || !n || (buf.data && !buf.size) || (!buf.data && buf.size))
+	polyline_trace_clock(t0);
+	polyline_trace(encode_start, POLYLINE_TRACE_ENCODE_START, 0, n);
+	if (!coords || !n || (buf.data && !buf.size) || (!buf.data && buf.size)) {
+		polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_EINVAL);
 		return POLYLINE_EINVAL;
+	}
 
-	float lat_prev = 0.0f, lng_prev = 0.0f;
-	uint8_t chunk[max_5bit_chunks];
+	uint32_t vals[block_values];
+	uint8_t chunk[1];
 
 	dprintf("start encode\n");
-	for (size_t i = 0; i < n; i++) {
-		float lat = coords[i * 2];
-		float lng = coords[i * 2 + 1];
-
-		lat = lat - lat_prev;
-		lng = lng - lng_prev;
+	for (size_t i = 0; i < n * 2; i += block_values) {
+		size_t count = n * 2 - i < block_values ? n * 2 - i : block_values;
 
-		lat_prev = coords[i * 2];
-		lng_prev = coords[i * 2 + 1];
-
-		size_t chunks = _polyline_encode_float(chunk, lat);
-		if (_add_chunks_to_buf(&buf, chunk, chunks, n - i)) {
-			return POLYLINE_ENOMEM;
-		}
-		chunks = _polyline_encode_float(chunk, lng);
-		if (_add_chunks_to_buf(&buf, chunk, chunks, n - i)) {
+		_encode_deltas(vals, coords, i, count);
+		if (_reserve_chunks(&buf, count * max_5bit_chunks_decode, n - i / 2)) {
+			polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_ENOMEM);
 			return POLYLINE_ENOMEM;
 		}
+		buf.idx += _encode_chunks((char *)buf.data + buf.idx, vals, count);
 	}
 	chunk[0] = '\0';
 	/*
@@ -170,6 +265,7 @@ polyline_encode(char **rptr, size_t *rsize, const float *coords, size_t n)
 	assert(!((char *)buf.data)[buf.idx - 1]);
 	dprintf("encode buf stats: allocs=%lu idx=%lu size=%lu strlen=%lu\n",
 	        buf.allocs, buf.idx, buf.size, strlen(buf.data));
+	polyline_trace(encode_end, POLYLINE_TRACE_ENCODE_END, t0, buf.idx - 1);
 	*rptr = buf.data;
 	*rsize = buf.size;
 	return buf.idx - 1;
@@ -177,18 +273,19 @@ polyline_encode(char **rptr, size_t *rsize, const float *coords, size_t n)
 
 
 /*
- * Allocate some memory with the assumption that only every 6 bytes
- * result in a coordinate.
+ * Make room for `n` more floats, with the assumption that only every
+ * 6 bytes of input left result in a coordinate.
  *
  * This will err on the side of not allocating too much memory.
  */
 static int
-_add_coords_to_buf(struct buf *buf, const float *latlng, size_t input_left) {
-	if (buf->idx >= buf->size) {
-		size_t new_size = buf->size + ((input_left / max_5bit_chunks) / 2 + 1) * 2;
+_reserve_coords(struct buf *buf, size_t n, size_t input_left) {
+	if (buf->idx + n > buf->size) {
+		size_t new_size = buf->size + n + ((input_left / max_5bit_chunks) / 2) * 2;
 		dprintf("realloc: input_left=%lu idx=%lu new_size=%lu "
 			"buf->size=%lu buf->data=%p\n",
 			input_left, buf->idx, new_size, buf->size, buf->data);
+		polyline_trace(grow, POLYLINE_TRACE_GROW, 0, new_size * sizeof(float));
 
 		buf->data = realloc(buf->data, new_size * sizeof(float));
 		if (!buf->data)
@@ -197,34 +294,59 @@ _add_coords_to_buf(struct buf *buf, const float *latlng, size_t input_left) {
 		buf->size = new_size;
 		buf->allocs += 1;
 	}
-	assert(buf->idx + 2 <= buf->size);
-	float *data = (float *)buf->data;
-	data[buf->idx] = latlng[0];
-	data[buf->idx + 1] = latlng[1];
-	buf->idx += 2;
+	assert(buf->idx + n <= buf->size);
 	return 0;
 }
 
-int
-polyline_decode(float **const rptr, size_t *rsize, const char *polyline)
+/*
+ * Decoding stage 2: zigzag decode and prefix sum of `count` interleaved
+ * lat/lng values onto the running position `acc`, then scale to floats.
+ * `count` must be even.
+ */
+static void
+_decode_prefix_sum(float *dst, const uint32_t *vals, size_t count, uint32_t *acc)
 {
-	struct buf buf = {
-		.data = *rptr,
-		.size = *rsize,
-	};
-	uint32_t val = 0;
-	size_t polyline_left = 0;
-	float latlng[2], prev_latlng[2] = {0.0f, 0.0f};
-	int latlng_idx = 0, chunk_idx = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128 p = _mm_set1_ps(precision);
+	const __m128i one = _mm_set1_epi32(1);
+	__m128i carry = _mm_set_epi32(acc[1], acc[0], acc[1], acc[0]);
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&vals[i]);
+		v = _mm_xor_si128(_mm_srli_epi32(v, 1),
+				  _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(v, one)));
+		/* [a0, b0, a1, b1] -> [a0, b0, a0 + a1, b0 + b1] */
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, carry);
+		carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 2, 3, 2));
+		_mm_storeu_ps(&dst[i], _mm_div_ps(_mm_cvtepi32_ps(v), p));
+	}
+	acc[0] = _mm_cvtsi128_si32(carry);
+	acc[1] = _mm_cvtsi128_si32(_mm_shuffle_epi32(carry, _MM_SHUFFLE(1, 1, 1, 1)));
+#endif
+	for (; i < count; i++) {
+		uint32_t val = vals[i];
+		acc[i & 1] += (val >> 1) ^ -(val & 1);
+		dst[i] = (float)(int32_t)acc[i & 1] / precision;
+	}
+}
 
-	if (!polyline || (buf.data && !buf.size) || (!buf.data && buf.size))
-		return POLYLINE_EINVAL;
+/*
+ * Decoding stage 1: characters to zigzag encoded values.
+ *
+ * Reads up to `max` values from `*rp` and advances it past them. Returns
+ * the number of values read, or a value < 0 on errors.
+ */
+static int
+_decode_values(const char **rp, uint32_t *vals, size_t max)
+{
+	const char *p = *rp;
+	uint32_t val = 0;
+	size_t count = 0;
+	int chunk_idx = 0;
 
-	polyline_left = strlen(polyline);
-	dprintf("start decode buf.size=%lu buf.data=%p polyline_left=%lu\n",
-			buf.size, buf.data, polyline_left);
-	while (*polyline) {
-		uint32_t chunk = *polyline++; polyline_left--;
+	while (*p && count < max) {
+		uint32_t chunk = (uint8_t)*p++;
 		dprintf("decode chunk: '%c'\n", chunk);
 		/*
 		 * 0001 1111    0x1f max input bits)
@@ -239,67 +361,1598 @@ polyline_decode(float **const rptr, size_t *rsize, const char *polyline)
 		 * Terminal characters set:
 		 * ?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\]^
 		 */
-		if (chunk < 0x3f || chunk > 0x7e) {
-			*rptr = buf.data;
-			*rsize = buf.size;
+		if (chunk < 0x3f || chunk > 0x7e || chunk_idx >= max_5bit_chunks_decode)
 			return POLYLINE_EPARSE;
-		}
 		chunk -= 0x3f;
 		val = val | ((chunk & ~0x20) << (chunk_idx * 5));
 		chunk_idx++;
 
 		if (!(chunk & 0x20)) {
-			int neg = 0;
-
-			/* Invert if originally negative. */
-			if (val & 0x01) {
-				val = ~val;
-				neg = 1;
-			}
-			val >>= 1;
-
-			/*
-			 * Reverse the two's compement operation. And
-			 * also make sure we properly sign extend the
-			 * shift that just happened (arithmetic shifting)
-			 */
-			if (neg) {
-				val |= (1 << 31);
-				val = ~(val - 1);
-			}
-
-			float f = (float)(val) / precision * (neg ? -1.0f : 1.0f);
-			latlng[latlng_idx++] = f;
-			if (latlng_idx > 1) {
-				prev_latlng[0] = prev_latlng[0] + latlng[0];
-				prev_latlng[1] = prev_latlng[1] + latlng[1];
-				if (_add_coords_to_buf(&buf, prev_latlng, polyline_left)) {
-					*rptr = NULL;
-					*rsize = 0;
-					return POLYLINE_ENOMEM;
-				}
-				latlng_idx = 0;
-			}
+			vals[count++] = val;
 
 			/* next round! */
 			chunk_idx = 0;
 			val = 0;
 		}
 	}
-
-	if (val > 0 || latlng_idx > 0 || chunk_idx > 0) {
-		*rptr = buf.data;
-		*rsize = buf.size;
+	*rp = p;
+	if (chunk_idx)
 		return POLYLINE_ETRUNC;
+	return count;
+}
+
+int
+polyline_decode(float **const rptr, size_t *rsize, const char *polyline)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	uint32_t acc[2] = {0, 0};
+	uint32_t vals[block_values];
+	size_t len = polyline ? strlen(polyline) : 0;
+	const char *end;
+	polyline_trace_clock(t0);
+	polyline_trace(decode_start, POLYLINE_TRACE_DECODE_START, 0, len);
+
+	if (!polyline || (buf.data && !buf.size) || (!buf.data && buf.size)) {
+		polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_EINVAL);
+		return POLYLINE_EINVAL;
+	}
+
+	end = polyline + len;
+	dprintf("start decode buf.size=%lu buf.data=%p polyline_left=%lu\n",
+			buf.size, buf.data, end - polyline);
+	while (*polyline) {
+		int count = _decode_values(&polyline, vals, block_values);
+		/* A trailing latitude without longitude means truncation. */
+		if (count >= 0 && (count & 1))
+			count = POLYLINE_ETRUNC;
+		if (count < 0) {
+			polyline_trace(error, POLYLINE_TRACE_ERROR, t0, count);
+			*rptr = buf.data;
+			*rsize = buf.size;
+			return count;
+		}
+
+		if (_reserve_coords(&buf, count, end - polyline)) {
+			polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_ENOMEM);
+			*rptr = NULL;
+			*rsize = 0;
+			return POLYLINE_ENOMEM;
+		}
+		_decode_prefix_sum((float *)buf.data + buf.idx, vals, count, acc);
+		buf.idx += count;
 	}
+
 	dprintf("decode buf stats: allocs=%lu idx=%lu size=%lu\n",
 		buf.allocs, buf.idx, buf.size);
+	polyline_trace(decode_end, POLYLINE_TRACE_DECODE_END, t0, buf.idx / 2);
 	*rptr = buf.data;
 	*rsize = buf.size;
 	return buf.idx / 2;
 }
 
 
+/*
+ * N-dimensional polylines.
+ *
+ * The header is a sequence of unsigned values: version, dimensions and
+ * one precision per dimension. The body holds zigzag encoded int64 deltas
+ * of all dimensions interleaved point by point. Accumulation is done on
+ * integers, so there is no drift regardless of the number of points.
+ */
+static const int max_5bit_chunks_64 = 13;
+
+/*
+ * Like _polyline_encode_float(), but for an already quantized and zigzag
+ * encoded 64-bit value.
+ */
+static int
+_polyline_encode_uint64(uint8_t *chunks, uint64_t val)
+{
+	int i = 0;
+	do {
+		uint8_t chunk = val & 0x1f;
+		val >>= 5;
+		chunk |= (val > 0 ? 0x20 : 0x00);
+		chunks[i++] = chunk + 63;
+	} while (val > 0);
+
+	assert(i <= max_5bit_chunks_64);
+	return i;
+}
+
+static inline uint64_t
+_zigzag_encode(uint64_t delta)
+{
+	return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static inline uint64_t
+_zigzag_decode(uint64_t val)
+{
+	return (val >> 1) ^ -(val & 1);
+}
+
+static void
+_nd_scales(double *scale, int dims, const int *precision)
+{
+	for (int d = 0; d < dims; d++) {
+		scale[d] = 1.0;
+		for (int p = 0; p < precision[d]; p++)
+			scale[d] *= 10.0;
+	}
+}
+
+int
+polyline_encode_nd(char **rptr, size_t *rsize, const double *coords,
+		   size_t n, int dims, const int *precision)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	if (!coords || !n || !precision || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+	if (dims < 1 || dims > POLYLINE_ND_MAX_DIMS)
+		return POLYLINE_EINVAL;
+	for (int d = 0; d < dims; d++)
+		if (precision[d] < 0 || precision[d] > POLYLINE_ND_MAX_PRECISION)
+			return POLYLINE_EINVAL;
+
+	double scale[POLYLINE_ND_MAX_DIMS];
+	uint64_t prev[POLYLINE_ND_MAX_DIMS] = {0};
+	uint8_t chunk[max_5bit_chunks_64];
+	size_t chunks;
+
+	_nd_scales(scale, dims, precision);
+
+	dprintf("start encode_nd dims=%d n=%lu\n", dims, n);
+	chunks = _polyline_encode_uint64(chunk, POLYLINE_ND_VERSION);
+	if (_add_chunks_to_buf(&buf, chunk, chunks, n * dims))
+		return POLYLINE_ENOMEM;
+	chunks = _polyline_encode_uint64(chunk, dims);
+	if (_add_chunks_to_buf(&buf, chunk, chunks, n * dims))
+		return POLYLINE_ENOMEM;
+	for (int d = 0; d < dims; d++) {
+		chunks = _polyline_encode_uint64(chunk, precision[d]);
+		if (_add_chunks_to_buf(&buf, chunk, chunks, n * dims))
+			return POLYLINE_ENOMEM;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		for (int d = 0; d < dims; d++) {
+			double v = round(coords[d * n + i] * scale[d]);
+			/* Also catches NaN. */
+			if (!(fabs(v) < 9.2e18)) {
+				*rptr = buf.data;
+				*rsize = buf.size;
+				return POLYLINE_ERANGE;
+			}
+			uint64_t q = (uint64_t)(int64_t)v;
+			chunks = _polyline_encode_uint64(chunk, _zigzag_encode(q - prev[d]));
+			prev[d] = q;
+			if (_add_chunks_to_buf(&buf, chunk, chunks, (n - i) * dims))
+				return POLYLINE_ENOMEM;
+		}
+	}
+	chunk[0] = '\0';
+	if (_add_chunks_to_buf(&buf, chunk, 1, 0))
+		return POLYLINE_ENOMEM;
+
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return buf.idx - 1;
+}
+
+/*
+ * Read one unsigned value of the header. Advances `*p`.
+ */
+static int
+_decode_uvarint(const char **p, uint64_t *rval)
+{
+	uint64_t val = 0;
+	for (int i = 0; i < max_5bit_chunks_64; i++) {
+		uint32_t chunk = (uint8_t)*(*p)++;
+		if (!chunk)
+			return POLYLINE_ETRUNC;
+		if (chunk < 0x3f || chunk > 0x7e)
+			return POLYLINE_EPARSE;
+		chunk -= 0x3f;
+		val |= (uint64_t)(chunk & 0x1f) << (i * 5);
+		if (!(chunk & 0x20)) {
+			*rval = val;
+			return 0;
+		}
+	}
+	return POLYLINE_EPARSE;
+}
+
+/*
+ * Validate the body and count its values. Every value ends with a
+ * terminal character, which is anything below '_'. Values of more than
+ * `max_chunks` characters are rejected the same way as by
+ * _decode_values(), with `max_5bit_chunks_decode` for 2D polylines.
+ */
+static int
+_count_values(const char *p, int max_chunks, size_t *rvalues)
+{
+	size_t values = 0;
+	int chunk_idx = 0;
+	for (; *p; p++) {
+		uint8_t c = *p;
+		if (c < 0x3f || c > 0x7e || chunk_idx >= max_chunks)
+			return POLYLINE_EPARSE;
+		if (c < 0x5f) {
+			values++;
+			chunk_idx = 0;
+		} else {
+			chunk_idx++;
+		}
+	}
+	if (chunk_idx)
+		return POLYLINE_ETRUNC;
+	*rvalues = values;
+	return 0;
+}
+
+/*
+ * Decode the validated body. Always inlined so that the switch in
+ * polyline_decode_nd() yields loops specialized for a constant `dims`.
+ */
+static inline __attribute__((always_inline)) void
+_decode_nd_body(double *dst, const char *p, size_t n, const int dims,
+		const double *scale)
+{
+	uint64_t prev[POLYLINE_ND_MAX_DIMS] = {0};
+	for (size_t i = 0; i < n; i++) {
+		for (int d = 0; d < dims; d++) {
+			uint64_t val = 0;
+			uint32_t chunk;
+			int shift = 0;
+			do {
+				chunk = (uint8_t)*p++ - 0x3f;
+				val |= (uint64_t)(chunk & 0x1f) << shift;
+				shift += 5;
+			} while (chunk & 0x20);
+			prev[d] += _zigzag_decode(val);
+			dst[d * n + i] = (double)(int64_t)prev[d] / scale[d];
+		}
+	}
+}
+
+int
+polyline_decode_nd(double **rptr, size_t *rsize, int *rdims,
+		   int *rprecision, const char *polyline)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	int precision[POLYLINE_ND_MAX_DIMS];
+	double scale[POLYLINE_ND_MAX_DIMS];
+	uint64_t val;
+	size_t values, n;
+	int r, dims;
+
+	if (!polyline || !rdims || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+
+	if ((r = _decode_uvarint(&polyline, &val)))
+		return r;
+	if (val != POLYLINE_ND_VERSION)
+		return POLYLINE_EPARSE;
+	if ((r = _decode_uvarint(&polyline, &val)))
+		return r;
+	if (val < 1 || val > POLYLINE_ND_MAX_DIMS)
+		return POLYLINE_EPARSE;
+	dims = val;
+	for (int d = 0; d < dims; d++) {
+		if ((r = _decode_uvarint(&polyline, &val)))
+			return r;
+		if (val > POLYLINE_ND_MAX_PRECISION)
+			return POLYLINE_EPARSE;
+		precision[d] = val;
+	}
+
+	if ((r = _count_values(polyline, max_5bit_chunks_64, &values)))
+		return r;
+	if (values % dims)
+		return POLYLINE_ETRUNC;
+	n = values / dims;
+
+	dprintf("start decode_nd dims=%d n=%lu buf.size=%lu\n", dims, n, buf.size);
+	if (buf.size < values) {
+		buf.data = realloc(buf.data, values * sizeof(double));
+		if (!buf.data) {
+			*rptr = NULL;
+			*rsize = 0;
+			return POLYLINE_ENOMEM;
+		}
+		buf.size = values;
+	}
+
+	_nd_scales(scale, dims, precision);
+	switch (dims) {
+	case 2:
+		_decode_nd_body(buf.data, polyline, n, 2, scale);
+		break;
+	case 3:
+		_decode_nd_body(buf.data, polyline, n, 3, scale);
+		break;
+	case 4:
+		_decode_nd_body(buf.data, polyline, n, 4, scale);
+		break;
+	default:
+		_decode_nd_body(buf.data, polyline, n, dims, scale);
+		break;
+	}
+
+	*rdims = dims;
+	if (rprecision)
+		memcpy(rprecision, precision, dims * sizeof(int));
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return n;
+}
+
+
+/*
+ * Structure-of-arrays variants.
+ *
+ * Decoding runs the same stage 1, then prefix sums each block into
+ * absolute int32 positions and scatters them into the lat and lng arrays
+ * while converting to the requested type. The block stays in L1, so there
+ * is no extra pass over memory.
+ */
+static void
+_decode_prefix_sum_i32(int32_t *dst, const uint32_t *vals, size_t count, uint32_t *acc)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i one = _mm_set1_epi32(1);
+	__m128i carry = _mm_set_epi32(acc[1], acc[0], acc[1], acc[0]);
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&vals[i]);
+		v = _mm_xor_si128(_mm_srli_epi32(v, 1),
+				  _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(v, one)));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, carry);
+		carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 2, 3, 2));
+		_mm_storeu_si128((__m128i *)&dst[i], v);
+	}
+	acc[0] = _mm_cvtsi128_si32(carry);
+	acc[1] = _mm_cvtsi128_si32(_mm_shuffle_epi32(carry, _MM_SHUFFLE(1, 1, 1, 1)));
+#endif
+	for (; i < count; i++) {
+		uint32_t val = vals[i];
+		acc[i & 1] += (val >> 1) ^ -(val & 1);
+		dst[i] = (int32_t)acc[i & 1];
+	}
+}
+
+static void
+_scatter_soa(void *lat, void *lng, size_t offset, const int32_t *pos,
+	     size_t pairs, int type)
+{
+	switch (type) {
+	case POLYLINE_FLOAT:
+		for (size_t i = 0; i < pairs; i++) {
+			((float *)lat)[offset + i] = (float)pos[i * 2] / precision;
+			((float *)lng)[offset + i] = (float)pos[i * 2 + 1] / precision;
+		}
+		break;
+	case POLYLINE_DOUBLE:
+		for (size_t i = 0; i < pairs; i++) {
+			((double *)lat)[offset + i] = (double)pos[i * 2] / precision;
+			((double *)lng)[offset + i] = (double)pos[i * 2 + 1] / precision;
+		}
+		break;
+	case POLYLINE_INT32:
+		for (size_t i = 0; i < pairs; i++) {
+			((int32_t *)lat)[offset + i] = pos[i * 2];
+			((int32_t *)lng)[offset + i] = pos[i * 2 + 1];
+		}
+		break;
+	}
+}
+
+int
+polyline_count(const char *polyline)
+{
+	size_t values;
+	int r;
+
+	if (!polyline)
+		return POLYLINE_EINVAL;
+	if ((r = _count_values(polyline, max_5bit_chunks_decode, &values)))
+		return r;
+	if (values & 1)
+		return POLYLINE_ETRUNC;
+	return values / 2;
+}
+
+int
+polyline_decode_soa(void *lat, void *lng, size_t n, int type, const char *polyline)
+{
+	uint32_t acc[2] = {0, 0};
+	uint32_t vals[block_values];
+	int32_t pos[block_values];
+	size_t coords = 0;
+
+	if (!polyline || (n && (!lat || !lng)))
+		return POLYLINE_EINVAL;
+	if (type != POLYLINE_FLOAT && type != POLYLINE_DOUBLE && type != POLYLINE_INT32)
+		return POLYLINE_EINVAL;
+
+	dprintf("start decode_soa n=%lu type=%d\n", n, type);
+	while (*polyline) {
+		int count = _decode_values(&polyline, vals, block_values);
+		if (count >= 0 && (count & 1))
+			count = POLYLINE_ETRUNC;
+		if (count < 0)
+			return count;
+		if (coords + count / 2 > n)
+			return POLYLINE_ENOSPC;
+
+		_decode_prefix_sum_i32(pos, vals, count, acc);
+		_scatter_soa(lat, lng, coords, pos, count / 2, type);
+		coords += count / 2;
+	}
+	return coords;
+}
+
+/*
+ * Encoding stage 1 for structure-of-arrays input: deltas, quantization
+ * and zigzag encoding of `pairs` coordinates starting at `start`,
+ * interleaved into `dst`. Float input is treated exactly like
+ * polyline_encode() does.
+ */
+static void
+_encode_deltas_soa(uint32_t *dst, const void *lat, const void *lng,
+		   size_t start, size_t pairs, int type)
+{
+	for (size_t i = start; i < start + pairs; i++) {
+		uint32_t *d = &dst[(i - start) * 2];
+		switch (type) {
+		case POLYLINE_FLOAT: {
+			const float *a = lat, *b = lng;
+			d[0] = _quantize_float(i ? a[i] - a[i - 1] : a[i]);
+			d[1] = _quantize_float(i ? b[i] - b[i - 1] : b[i]);
+			break;
+		}
+		case POLYLINE_DOUBLE: {
+			const double *a = lat, *b = lng;
+			for (int k = 0; k < 2; k++) {
+				const double *c = k ? b : a;
+				double f = i ? c[i] - c[i - 1] : c[i];
+				int32_t val = (int32_t)(fabs(f * precision) + 0.5);
+				if (f < 0.0)
+					val = -val;
+				d[k] = ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+			}
+			break;
+		}
+		case POLYLINE_INT32: {
+			const int32_t *a = lat, *b = lng;
+			uint32_t dlat = (uint32_t)a[i] - (i ? (uint32_t)a[i - 1] : 0);
+			uint32_t dlng = (uint32_t)b[i] - (i ? (uint32_t)b[i - 1] : 0);
+			d[0] = (dlat << 1) ^ (uint32_t)((int32_t)dlat >> 31);
+			d[1] = (dlng << 1) ^ (uint32_t)((int32_t)dlng >> 31);
+			break;
+		}
+		}
+	}
+}
+
+int
+polyline_encode_soa(char **rptr, size_t *rsize, const void *lat,
+		    const void *lng, size_t n, int type)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	if (!lat || !lng || !n || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+	if (type != POLYLINE_FLOAT && type != POLYLINE_DOUBLE && type != POLYLINE_INT32)
+		return POLYLINE_EINVAL;
+
+	uint32_t vals[block_values];
+	uint8_t chunk[1];
+
+	dprintf("start encode_soa n=%lu type=%d\n", n, type);
+	for (size_t i = 0; i < n; i += block_values / 2) {
+		size_t pairs = n - i < block_values / 2 ? n - i : block_values / 2;
+
+		_encode_deltas_soa(vals, lat, lng, i, pairs, type);
+		if (_reserve_chunks(&buf, pairs * 2 * max_5bit_chunks_decode, n - i))
+			return POLYLINE_ENOMEM;
+		buf.idx += _encode_chunks((char *)buf.data + buf.idx, vals, pairs * 2);
+	}
+	chunk[0] = '\0';
+	if (_add_chunks_to_buf(&buf, chunk, 1, 0))
+		return POLYLINE_ENOMEM;
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return buf.idx - 1;
+}
+
+
+/*
+ * Transcoding between precisions.
+ *
+ * Zigzag values are accumulated into absolute integer positions, which
+ * are rescaled and delta encoded again right away. Rescaling absolute
+ * positions instead of deltas keeps rounding errors from accumulating.
+ */
+static inline int
+_rescale(int64_t val, int64_t mul, int64_t div, int64_t *rout)
+{
+	if (mul > 1) {
+		if (val > INT64_MAX / mul || val < INT64_MIN / mul)
+			return POLYLINE_ERANGE;
+		*rout = val * mul;
+	} else if (div > 1) {
+		/* Round half away from zero, same as the encoders. */
+		int64_t q = val / div, r = val % div, half = div / 2;
+		*rout = q + (r >= half) - (-r >= half);
+	} else {
+		*rout = val;
+	}
+	return 0;
+}
+
+int
+polyline_transcode(char **rptr, size_t *rsize, const char *polyline,
+		   int src_precision, int dst_precision)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	int64_t mul = 1, div = 1;
+	uint64_t val = 0, acc[2] = {0, 0}, prev[2] = {0, 0};
+	size_t polyline_left, k = 0;
+	int chunk_idx = 0;
+
+	if (!polyline || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+	if (src_precision < 0 || src_precision > POLYLINE_ND_MAX_PRECISION ||
+	    dst_precision < 0 || dst_precision > POLYLINE_ND_MAX_PRECISION)
+		return POLYLINE_EINVAL;
+
+	for (int p = src_precision; p < dst_precision; p++)
+		mul *= 10;
+	for (int p = dst_precision; p < src_precision; p++)
+		div *= 10;
+
+	polyline_left = strlen(polyline);
+	dprintf("start transcode %d -> %d polyline_left=%lu\n",
+		src_precision, dst_precision, polyline_left);
+	while (*polyline) {
+		uint32_t chunk = (uint8_t)*polyline++; polyline_left--;
+		if (chunk < 0x3f || chunk > 0x7e || chunk_idx >= max_5bit_chunks_64) {
+			*rptr = buf.data;
+			*rsize = buf.size;
+			return POLYLINE_EPARSE;
+		}
+		chunk -= 0x3f;
+		val |= (uint64_t)(chunk & 0x1f) << (chunk_idx++ * 5);
+		if (chunk & 0x20)
+			continue;
+
+		int64_t out;
+		acc[k & 1] += _zigzag_decode(val);
+		if (_rescale((int64_t)acc[k & 1], mul, div, &out)) {
+			*rptr = buf.data;
+			*rsize = buf.size;
+			return POLYLINE_ERANGE;
+		}
+		if (_reserve_chunks(&buf, max_5bit_chunks_64, polyline_left / 4 + 1))
+			return POLYLINE_ENOMEM;
+		buf.idx += _polyline_encode_uint64((uint8_t *)buf.data + buf.idx,
+						   _zigzag_encode((uint64_t)out - prev[k & 1]));
+		prev[k & 1] = out;
+		k++;
+		val = 0;
+		chunk_idx = 0;
+	}
+
+	if (chunk_idx || (k & 1)) {
+		*rptr = buf.data;
+		*rsize = buf.size;
+		return POLYLINE_ETRUNC;
+	}
+
+	uint8_t nul = '\0';
+	if (_add_chunks_to_buf(&buf, &nul, 1, 0))
+		return POLYLINE_ENOMEM;
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return buf.idx - 1;
+}
+
+
+/*
+ * Delta of delta polylines.
+ *
+ * After a header holding @ref POLYLINE_DOD_VERSION, the body has the same
+ * alphabet and chunking as standard polylines, but every value is the
+ * difference between two consecutive deltas of a latitude or longitude.
+ * Values are converted block wise between the orders in front of the
+ * standard stage 2, so the standard kernels do the actual work.
+ */
+static inline uint32_t
+_zigzag_encode_i32(uint32_t v)
+{
+	return (v << 1) ^ -(v >> 31);
+}
+
+/*
+ * Zigzag encoded first order deltas to second order ones, in place.
+ * `prev` holds the last lat/lng deltas.
+ */
+static void
+_dod_differentiate(uint32_t *vals, size_t count, uint32_t *prev)
+{
+	for (size_t i = 0; i < count; i++) {
+		uint32_t d = (vals[i] >> 1) ^ -(vals[i] & 1);
+		vals[i] = _zigzag_encode_i32(d - prev[i & 1]);
+		prev[i & 1] = d;
+	}
+}
+
+/*
+ * The reverse of _dod_differentiate().
+ */
+static void
+_dod_integrate(uint32_t *vals, size_t count, uint32_t *prev)
+{
+	for (size_t i = 0; i < count; i++) {
+		prev[i & 1] += (vals[i] >> 1) ^ -(vals[i] & 1);
+		vals[i] = _zigzag_encode_i32(prev[i & 1]);
+	}
+}
+
+static int
+_dod_header(struct buf *buf, size_t coords_left)
+{
+	uint8_t chunk[max_5bit_chunks_64];
+	size_t chunks = _polyline_encode_uint64(chunk, POLYLINE_DOD_VERSION);
+	return _add_chunks_to_buf(buf, chunk, chunks, coords_left);
+}
+
+static int
+_dod_check_header(const char **polyline)
+{
+	uint64_t version;
+	int r;
+
+	if ((r = _decode_uvarint(polyline, &version)))
+		return r;
+	return version == POLYLINE_DOD_VERSION ? 0 : POLYLINE_EPARSE;
+}
+
+int
+polyline_encode_dod(char **rptr, size_t *rsize, const float *coords, size_t n)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	uint32_t vals[block_values], prev[2] = {0, 0};
+	uint8_t nul = '\0';
+
+	if (!coords || !n || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+
+	dprintf("start encode_dod n=%lu\n", n);
+	if (_dod_header(&buf, n))
+		return POLYLINE_ENOMEM;
+	for (size_t i = 0; i < n * 2; i += block_values) {
+		size_t count = n * 2 - i < block_values ? n * 2 - i : block_values;
+
+		_encode_deltas(vals, coords, i, count);
+		_dod_differentiate(vals, count, prev);
+		if (_reserve_chunks(&buf, count * max_5bit_chunks_decode, n - i / 2))
+			return POLYLINE_ENOMEM;
+		buf.idx += _encode_chunks((char *)buf.data + buf.idx, vals, count);
+	}
+	if (_add_chunks_to_buf(&buf, &nul, 1, 0))
+		return POLYLINE_ENOMEM;
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return buf.idx - 1;
+}
+
+int
+polyline_decode_dod(float **rptr, size_t *rsize, const char *polyline)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	uint32_t acc[2] = {0, 0}, prev[2] = {0, 0};
+	uint32_t vals[block_values];
+	const char *end;
+	int r;
+
+	if (!polyline || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+	if ((r = _dod_check_header(&polyline)))
+		return r;
+
+	end = polyline + strlen(polyline);
+	dprintf("start decode_dod polyline_left=%lu\n", end - polyline);
+	while (*polyline) {
+		int count = _decode_values(&polyline, vals, block_values);
+		if (count >= 0 && (count & 1))
+			count = POLYLINE_ETRUNC;
+		if (count < 0) {
+			*rptr = buf.data;
+			*rsize = buf.size;
+			return count;
+		}
+
+		if (_reserve_coords(&buf, count, end - polyline)) {
+			*rptr = NULL;
+			*rsize = 0;
+			return POLYLINE_ENOMEM;
+		}
+		_dod_integrate(vals, count, prev);
+		_decode_prefix_sum((float *)buf.data + buf.idx, vals, count, acc);
+		buf.idx += count;
+	}
+
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return buf.idx / 2;
+}
+
+static int
+_dod_transcode(char **rptr, size_t *rsize, const char *polyline, int to_dod)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	uint32_t vals[block_values], prev[2] = {0, 0};
+	uint8_t nul = '\0';
+	size_t polyline_left;
+	int r;
+
+	if (!polyline || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+	if (!to_dod && (r = _dod_check_header(&polyline)))
+		return r;
+
+	polyline_left = strlen(polyline);
+	if (to_dod && _dod_header(&buf, polyline_left / 4))
+		return POLYLINE_ENOMEM;
+	while (*polyline) {
+		const char *start = polyline;
+		int count = _decode_values(&polyline, vals, block_values);
+		if (count >= 0 && (count & 1))
+			count = POLYLINE_ETRUNC;
+		if (count < 0) {
+			*rptr = buf.data;
+			*rsize = buf.size;
+			return count;
+		}
+		polyline_left -= polyline - start;
+
+		if (to_dod)
+			_dod_differentiate(vals, count, prev);
+		else
+			_dod_integrate(vals, count, prev);
+		if (_reserve_chunks(&buf, count * max_5bit_chunks_decode, polyline_left / 4))
+			return POLYLINE_ENOMEM;
+		buf.idx += _encode_chunks((char *)buf.data + buf.idx, vals, count);
+	}
+	if (_add_chunks_to_buf(&buf, &nul, 1, 0))
+		return POLYLINE_ENOMEM;
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return buf.idx - 1;
+}
+
+int
+polyline_dod_from_polyline(char **rptr, size_t *rsize, const char *polyline)
+{
+	return _dod_transcode(rptr, rsize, polyline, 1);
+}
+
+int
+polyline_dod_to_polyline(char **rptr, size_t *rsize, const char *polyline)
+{
+	return _dod_transcode(rptr, rsize, polyline, 0);
+}
+
+
+/*
+ * Similarity metrics between two polylines.
+ *
+ * Polylines are decoded incrementally into blocks of integer positions,
+ * distances are planar and computed on those integers. The Hausdorff
+ * distance and the shared prefix need nothing beyond a few blocks on the
+ * stack. The Fréchet distance keeps all positions of `b` and one row of
+ * the dynamic program on the heap, 16 bytes per point of `b`.
+ */
+struct _reader {
+	const char *p;
+	uint32_t acc[2];
+	int32_t *pos;           /* block_values positions */
+};
+
+static void
+_reader_init(struct _reader *r, const char *polyline, int32_t *pos)
+{
+	r->p = polyline;
+	r->acc[0] = r->acc[1] = 0;
+	r->pos = pos;
+}
+
+/*
+ * Decode the next block into `r->pos`. Returns the number of points in
+ * it, 0 at the end or a value < 0 on errors.
+ */
+static int
+_reader_next(struct _reader *r)
+{
+	uint32_t vals[block_values];
+
+	if (!*r->p)
+		return 0;
+	int count = _decode_values(&r->p, vals, block_values);
+	if (count >= 0 && (count & 1))
+		count = POLYLINE_ETRUNC;
+	if (count < 0)
+		return count;
+	_decode_prefix_sum_i32(r->pos, vals, count, r->acc);
+	return count / 2;
+}
+
+static inline double
+_dist2(const int32_t *a, const int32_t *b)
+{
+	double dlat = (double)((int64_t)a[0] - b[0]);
+	double dlng = (double)((int64_t)a[1] - b[1]);
+	return dlat * dlat + dlng * dlng;
+}
+
+static double
+_threshold2(double threshold)
+{
+	double t = threshold * precision;
+	return t * t;
+}
+
+static int
+_count_both(const char *a, const char *b, int *rn, int *rm)
+{
+	if (!a || !b)
+		return POLYLINE_EINVAL;
+	if ((*rn = polyline_count(a)) < 0)
+		return *rn;
+	if ((*rm = polyline_count(b)) < 0)
+		return *rm;
+	return (*rn && *rm) ? 0 : POLYLINE_EINVAL;
+}
+
+/*
+ * Directed Hausdorff distance from `a` to `b`, raising `*rmax`. A point
+ * of `a` stops being compared once it is closer to `b` than `*rmax`, as
+ * it can no longer raise it. Returns 1 once `*rmax` exceeds `thr2`.
+ */
+static int
+_directed_hausdorff(double *rmax, const char *a, const char *b, double thr2)
+{
+	struct _reader ra, rb;
+	int32_t apos[block_values], bpos[block_values];
+	double mins[block_values / 2];
+	int na, nb = 0;
+
+	_reader_init(&ra, a, apos);
+	while ((na = _reader_next(&ra)) > 0) {
+		int active = na;
+		for (int i = 0; i < na; i++)
+			mins[i] = INFINITY;
+
+		_reader_init(&rb, b, bpos);
+		while (active && (nb = _reader_next(&rb)) > 0) {
+			active = 0;
+			for (int i = 0; i < na; i++) {
+				if (mins[i] <= *rmax)
+					continue;
+				double min = mins[i];
+				for (int j = 0; j < nb; j++) {
+					double d = _dist2(&ra.pos[i * 2], &rb.pos[j * 2]);
+					min = d < min ? d : min;
+				}
+				mins[i] = min;
+				active += min > *rmax;
+			}
+		}
+		if (nb < 0)
+			return nb;
+		for (int i = 0; i < na; i++) {
+			if (mins[i] > *rmax)
+				*rmax = mins[i];
+		}
+		if (*rmax > thr2)
+			return 1;
+	}
+	return na;
+}
+
+int
+polyline_hausdorff(double *rdist, const char *a, const char *b, double threshold)
+{
+	double max = 0, thr2 = _threshold2(threshold);
+	int n, m, r;
+
+	if (!rdist || threshold < 0 || isnan(threshold))
+		return POLYLINE_EINVAL;
+	if ((r = _count_both(a, b, &n, &m)))
+		return r;
+
+	if (!(r = _directed_hausdorff(&max, a, b, thr2)))
+		r = _directed_hausdorff(&max, b, a, thr2);
+	if (r >= 0)
+		*rdist = sqrt(max) / precision;
+	return r;
+}
+
+int
+polyline_frechet(double *rdist, const char *a, const char *b, double threshold)
+{
+	struct _reader r;
+	int32_t pos[block_values];
+	double thr2 = _threshold2(threshold);
+	double *row = NULL;
+	int32_t *bpos = NULL;
+	int n, m, count, first = 1, ret;
+	size_t k = 0;
+
+	if (!rdist || threshold < 0 || isnan(threshold))
+		return POLYLINE_EINVAL;
+	if ((ret = _count_both(a, b, &n, &m)))
+		return ret;
+	if (!(bpos = malloc(m * 2 * sizeof(*bpos))) || !(row = malloc(m * sizeof(*row)))) {
+		ret = POLYLINE_ENOMEM;
+		goto free;
+	}
+
+	_reader_init(&r, b, pos);
+	while ((count = _reader_next(&r)) > 0) {
+		memcpy(bpos + k, r.pos, count * 2 * sizeof(*bpos));
+		k += count * 2;
+	}
+	if (count < 0) {
+		ret = count;
+		goto free;
+	}
+
+	_reader_init(&r, a, pos);
+	while ((count = _reader_next(&r)) > 0) {
+		for (int i = 0; i < count; i++) {
+			const int32_t *pa = &r.pos[i * 2];
+			double diag, rowmin;
+			if (first) {
+				row[0] = _dist2(pa, bpos);
+				for (int j = 1; j < m; j++) {
+					double d = _dist2(pa, &bpos[j * 2]);
+					row[j] = d > row[j - 1] ? d : row[j - 1];
+				}
+				first = 0;
+			} else {
+				double d = _dist2(pa, bpos);
+				diag = row[0];
+				row[0] = d > row[0] ? d : row[0];
+				for (int j = 1; j < m; j++) {
+					double up = row[j], best;
+					d = _dist2(pa, &bpos[j * 2]);
+					best = up < diag ? up : diag;
+					best = row[j - 1] < best ? row[j - 1] : best;
+					row[j] = d > best ? d : best;
+					diag = up;
+				}
+			}
+
+			/* Every coupling crosses this row, none can be below its minimum. */
+			rowmin = row[0];
+			for (int j = 1; j < m; j++)
+				rowmin = row[j] < rowmin ? row[j] : rowmin;
+			if (rowmin > thr2) {
+				*rdist = sqrt(rowmin) / precision;
+				ret = 1;
+				goto free;
+			}
+		}
+	}
+	if (count < 0) {
+		ret = count;
+		goto free;
+	}
+	*rdist = sqrt(row[m - 1]) / precision;
+	ret = 0;
+free:
+	free(bpos);
+	free(row);
+	return ret;
+}
+
+int
+polyline_shared_prefix(const char *a, const char *b, double tolerance)
+{
+	struct _reader ra, rb;
+	int32_t apos[block_values], bpos[block_values];
+	double tol2 = _threshold2(tolerance);
+	int na, nb = 0, shared = 0;
+
+	if (!a || !b || tolerance < 0 || isnan(tolerance))
+		return POLYLINE_EINVAL;
+
+	_reader_init(&ra, a, apos);
+	_reader_init(&rb, b, bpos);
+	/* Both readers fill blocks of the same size, so blocks line up. */
+	while ((na = _reader_next(&ra)) > 0 && (nb = _reader_next(&rb)) > 0) {
+		int n = na < nb ? na : nb;
+		for (int i = 0; i < n; i++) {
+			if (_dist2(&ra.pos[i * 2], &rb.pos[i * 2]) > tol2)
+				return shared;
+			shared++;
+		}
+		if (na != nb)
+			return shared;
+	}
+	if (na < 0)
+		return na;
+	if (na > 0 && nb < 0)
+		return nb;
+	return shared;
+}
+
+
+/*
+ * Clipping a polyline to a bounding box.
+ *
+ * Points are classified by Cohen-Sutherland outcodes. Segments inside,
+ * or entirely on the outer side of one edge, need nothing more, which
+ * makes long stretches outside the box cheap. Segments crossing an edge
+ * are clipped with Liang-Barsky on integers, parameters are kept as
+ * fractions and compared by cross multiplication. Inside runs are delta
+ * and chunk encoded right away into one reused buffer.
+ */
+#define CLIP_BELOW 1
+#define CLIP_ABOVE 2
+#define CLIP_LEFT 4
+#define CLIP_RIGHT 8
+
+/* Keeps all differences and products of the clipper within int64. */
+static const int32_t clip_max = 1 << 30;
+
+struct _clip_out {
+	struct buf buf;
+	int32_t last[2];        /* last point emitted, for deltas */
+	size_t points;
+	int single;             /* input has a single point */
+	polyline_clip_fn fn;
+	void *ctx;
+	int segments;
+	int stop;
+};
+
+static inline int
+_outcode(const int32_t *p, const struct polyline_bbox *b)
+{
+	return (p[0] < b->min_lat ? CLIP_BELOW : 0) |
+	       (p[0] > b->max_lat ? CLIP_ABOVE : 0) |
+	       (p[1] < b->min_lng ? CLIP_LEFT : 0) |
+	       (p[1] > b->max_lng ? CLIP_RIGHT : 0);
+}
+
+static int
+_clip_add(struct _clip_out *out, const int32_t *p)
+{
+	uint32_t vals[2];
+
+	if (_reserve_chunks(&out->buf, 2 * max_5bit_chunks_decode + 1, 1))
+		return POLYLINE_ENOMEM;
+	for (int k = 0; k < 2; k++) {
+		uint32_t delta = (uint32_t)p[k] - (uint32_t)(out->points ? out->last[k] : 0);
+		vals[k] = (delta << 1) ^ -(delta >> 31);
+		out->last[k] = p[k];
+	}
+	out->buf.idx += _encode_chunks((char *)out->buf.data + out->buf.idx, vals, 2);
+	out->points++;
+	return 0;
+}
+
+/*
+ * Hand the open run to the callback. Runs of a single point only come
+ * from touching the box and are dropped, unless the input is one point.
+ */
+static void
+_clip_emit(struct _clip_out *out)
+{
+	if (out->points > 1 || (out->points && out->single)) {
+		((char *)out->buf.data)[out->buf.idx] = '\0';
+		out->segments++;
+		out->stop = out->fn(out->buf.data, out->buf.idx, out->ctx);
+	}
+	out->buf.idx = 0;
+	out->points = 0;
+}
+
+/*
+ * Round n / d half away from zero, d > 0.
+ */
+static inline int64_t
+_div_round(int64_t n, int64_t d)
+{
+	return n >= 0 ? (n + d / 2) / d : -((-n + d / 2) / d);
+}
+
+static inline int32_t
+_clamp(int64_t v, int32_t min, int32_t max)
+{
+	return v < min ? min : v > max ? max : (int32_t)v;
+}
+
+/*
+ * Clip the segment from `p` to `q` into `c0` and `c1`. Returns 1 if part
+ * of it is inside the box, 0 if not.
+ */
+static int
+_clip_segment(int32_t *c0, int32_t *c1, const int32_t *p, const int32_t *q,
+	      const struct polyline_bbox *b)
+{
+	const int64_t d[2] = {(int64_t)q[0] - p[0], (int64_t)q[1] - p[1]};
+	const int32_t min[2] = {b->min_lat, b->min_lng};
+	const int32_t max[2] = {b->max_lat, b->max_lng};
+	/* Entry and exit parameters t = n / d with d > 0. */
+	int64_t n0 = 0, d0 = 1, n1 = 1, d1 = 1;
+
+	for (int k = 0; k < 4; k++) {
+		int axis = k >> 1;
+		int64_t pk = (k & 1) ? d[axis] : -d[axis];
+		int64_t qk = (k & 1) ? (int64_t)max[axis] - p[axis] : (int64_t)p[axis] - min[axis];
+		if (!pk) {
+			if (qk < 0)
+				return 0;
+		} else if (pk < 0) {
+			/* Entering, t = -qk / -pk. */
+			if (-qk * d0 > n0 * -pk) {
+				n0 = -qk;
+				d0 = -pk;
+			}
+		} else if (qk * d1 < n1 * pk) {
+			/* Leaving, t = qk / pk. */
+			n1 = qk;
+			d1 = pk;
+		}
+	}
+	if (n0 * d1 > n1 * d0)
+		return 0;
+
+	for (int k = 0; k < 2; k++) {
+		c0[k] = n0 ? _clamp(p[k] + _div_round(d[k] * n0, d0), min[k], max[k]) : p[k];
+		c1[k] = n1 != d1 ? _clamp(p[k] + _div_round(d[k] * n1, d1), min[k], max[k]) : q[k];
+	}
+	return 1;
+}
+
+int
+polyline_clip(const char *polyline, const struct polyline_bbox *bbox,
+	      polyline_clip_fn fn, void *ctx)
+{
+	struct _clip_out out = {
+		.fn = fn,
+		.ctx = ctx,
+	};
+	struct _reader r;
+	int32_t pos[block_values];
+	int32_t prev[2], c0[2], c1[2];
+	int count, prev_code = -1, ret = 0;
+
+	if (!polyline || !bbox || !fn ||
+	    bbox->min_lat > bbox->max_lat || bbox->min_lng > bbox->max_lng ||
+	    bbox->min_lat < -clip_max || bbox->max_lat > clip_max ||
+	    bbox->min_lng < -clip_max || bbox->max_lng > clip_max)
+		return POLYLINE_EINVAL;
+	if ((count = polyline_count(polyline)) < 0)
+		return count;
+	out.single = count == 1;
+
+	dprintf("start clip bbox=[%d, %d, %d, %d]\n", bbox->min_lat,
+		bbox->min_lng, bbox->max_lat, bbox->max_lng);
+	_reader_init(&r, polyline, pos);
+	while (!out.stop && (count = _reader_next(&r)) > 0) {
+		for (int i = 0; i < count && !out.stop; i++) {
+			const int32_t *q = &pos[i * 2];
+			int code = _outcode(q, bbox);
+
+			if (prev_code < 0) {
+				/* First point */
+				if (!code)
+					ret = _clip_add(&out, q);
+			} else if (!(prev_code | code)) {
+				ret = _clip_add(&out, q);
+			} else if (!(prev_code & code)) {
+				if (prev[0] < -clip_max || prev[0] > clip_max ||
+				    prev[1] < -clip_max || prev[1] > clip_max ||
+				    q[0] < -clip_max || q[0] > clip_max ||
+				    q[1] < -clip_max || q[1] > clip_max) {
+					ret = POLYLINE_ERANGE;
+					goto free;
+				}
+				if (_clip_segment(c0, c1, prev, q, bbox)) {
+					int same = c0[0] == c1[0] && c0[1] == c1[1];
+					/* Entering, unless only touching the box. */
+					if (prev_code && !(same && code))
+						ret = _clip_add(&out, c0);
+					if (!ret && !same)
+						ret = _clip_add(&out, c1);
+				}
+				if (code)
+					_clip_emit(&out);
+			}
+			if (ret)
+				goto free;
+			prev[0] = q[0];
+			prev[1] = q[1];
+			prev_code = code;
+		}
+	}
+	if (count < 0) {
+		ret = count;
+		goto free;
+	}
+	if (!out.stop)
+		_clip_emit(&out);
+	ret = out.segments;
+free:
+	free(out.buf.data);
+	return ret;
+}
+
+
+/*
+ * Parallel decoding of a single polyline.
+ *
+ * Every value ends with a terminal character, so the string is split
+ * into chunks right after terminals. In a first parallel pass each chunk
+ * is validated, its values counted and its deltas summed separately for
+ * values at even and odd positions within the chunk. A serial prefix sum
+ * over the chunks yields the global value offset, and with it the lat/lng
+ * parity, and the absolute start position of every chunk. A second
+ * parallel pass decodes again and writes the absolute coordinates.
+ */
+static const size_t parallel_min_chunk = 64 * 1024;
+#define PARALLEL_MAX_THREADS 64
+
+struct _parallel_chunk {
+	const char *start;
+	const char *end;
+	size_t values;
+	int64_t sums[2];
+	int error;
+	size_t offset;
+	int64_t base[2];
+	float *dst;
+	int pass;
+};
+
+static void *
+_decode_parallel_chunk(void *arg)
+{
+	struct _parallel_chunk *c = arg;
+	int64_t acc[2] = {c->base[0], c->base[1]};
+	size_t k = 0;
+	uint32_t val = 0;
+	int chunk_idx = 0;
+
+	for (const char *p = c->start; p < c->end; p++) {
+		uint32_t chunk = (uint8_t)*p;
+		if (chunk < 0x3f || chunk > 0x7e || chunk_idx >= max_5bit_chunks_decode) {
+			c->error = POLYLINE_EPARSE;
+			return NULL;
+		}
+		chunk -= 0x3f;
+		val |= (chunk & 0x1f) << (chunk_idx++ * 5);
+		if (chunk & 0x20)
+			continue;
+
+		int32_t delta = (int32_t)((val >> 1) ^ -(val & 1));
+		if (c->pass == 0) {
+			c->sums[k & 1] += delta;
+		} else {
+			size_t g = c->offset + k;
+			acc[g & 1] += delta;
+			c->dst[g] = (float)acc[g & 1] / precision;
+		}
+		k++;
+		val = 0;
+		chunk_idx = 0;
+	}
+	/* Only the last chunk may end in the middle of a value. */
+	if (chunk_idx)
+		c->error = POLYLINE_ETRUNC;
+	c->values = k;
+	return NULL;
+}
+
+static void
+_decode_parallel_pass(struct _parallel_chunk *chunks, int nthreads, int pass)
+{
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	int started[PARALLEL_MAX_THREADS];
+
+	for (int t = 1; t < nthreads; t++) {
+		chunks[t].pass = pass;
+		started[t] = !pthread_create(&threads[t], NULL,
+					     _decode_parallel_chunk, &chunks[t]);
+	}
+	/* The calling thread takes the first chunk, and any that failed to start. */
+	chunks[0].pass = pass;
+	_decode_parallel_chunk(&chunks[0]);
+	for (int t = 1; t < nthreads; t++) {
+		if (started[t])
+			pthread_join(threads[t], NULL);
+		else
+			_decode_parallel_chunk(&chunks[t]);
+	}
+}
+
+int
+polyline_decode_parallel(float **rptr, size_t *rsize, const char *polyline,
+			 int nthreads)
+{
+	struct buf buf = {
+		.data = *rptr,
+		.size = *rsize,
+	};
+	size_t len, values = 0;
+	int64_t abs[2] = {0, 0};
+
+	if (!polyline || nthreads < 1 || (buf.data && !buf.size) || (!buf.data && buf.size))
+		return POLYLINE_EINVAL;
+
+	len = strlen(polyline);
+	if ((size_t)nthreads > len / parallel_min_chunk + 1)
+		nthreads = len / parallel_min_chunk + 1;
+	if (nthreads > PARALLEL_MAX_THREADS)
+		nthreads = PARALLEL_MAX_THREADS;
+
+	struct _parallel_chunk chunks[PARALLEL_MAX_THREADS];
+	const char *start = polyline, *end = polyline + len;
+	memset(chunks, 0, sizeof(chunks));
+	for (int t = 0; t < nthreads; t++) {
+		const char *split = polyline + len * (t + 1) / nthreads;
+		if (split < start)
+			split = start;
+		/* Move the split right behind the next terminal character. */
+		while (split < end && (uint8_t)split[-1] >= 0x5f)
+			split++;
+		chunks[t].start = start;
+		chunks[t].end = split;
+		start = split;
+	}
+	dprintf("start decode_parallel len=%lu nthreads=%d\n", len, nthreads);
+
+	_decode_parallel_pass(chunks, nthreads, 0);
+	for (int t = 0; t < nthreads; t++) {
+		if (chunks[t].error) {
+			*rptr = buf.data;
+			*rsize = buf.size;
+			return chunks[t].error;
+		}
+		chunks[t].offset = values;
+		chunks[t].base[0] = abs[0];
+		chunks[t].base[1] = abs[1];
+		abs[values & 1] += chunks[t].sums[0];
+		abs[(values + 1) & 1] += chunks[t].sums[1];
+		values += chunks[t].values;
+	}
+	if (values & 1) {
+		*rptr = buf.data;
+		*rsize = buf.size;
+		return POLYLINE_ETRUNC;
+	}
+
+	if (buf.size < values) {
+		buf.data = realloc(buf.data, values * sizeof(float));
+		if (!buf.data) {
+			*rptr = NULL;
+			*rsize = 0;
+			return POLYLINE_ENOMEM;
+		}
+		buf.size = values;
+	}
+	for (int t = 0; t < nthreads; t++)
+		chunks[t].dst = buf.data;
+	_decode_parallel_pass(chunks, nthreads, 1);
+
+	*rptr = buf.data;
+	*rsize = buf.size;
+	return values / 2;
+}
+
+
+/*
+ * Reusable contexts.
+ *
+ * Output buffers start out as arrays within the context, which hold any
+ * polyline of up to CTX_SMALL_POINTS points, and only move to the heap
+ * when a larger one comes along. They never shrink, so a context reaches
+ * a steady state without allocations.
+ */
+#define CTX_SMALL_POINTS 64
+
+struct polyline_ctx {
+	float *coords;          /* small_coords or on the heap */
+	size_t coords_size;     /* floats */
+	char *chars;            /* small_chars or on the heap */
+	size_t chars_size;
+	float small_coords[CTX_SMALL_POINTS * 2];
+	char small_chars[CTX_SMALL_POINTS * 2 * 7 + 1];
+};
+
+int
+polyline_ctx_create(struct polyline_ctx **rctx)
+{
+	struct polyline_ctx *ctx;
+
+	if (!rctx)
+		return POLYLINE_EINVAL;
+	if (!(ctx = malloc(sizeof(*ctx))))
+		return POLYLINE_ENOMEM;
+	ctx->coords = ctx->small_coords;
+	ctx->coords_size = sizeof(ctx->small_coords) / sizeof(float);
+	ctx->chars = ctx->small_chars;
+	ctx->chars_size = sizeof(ctx->small_chars);
+	*rctx = ctx;
+	return 0;
+}
+
+void
+polyline_ctx_destroy(struct polyline_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx->coords != ctx->small_coords)
+		free(ctx->coords);
+	if (ctx->chars != ctx->small_chars)
+		free(ctx->chars);
+	free(ctx);
+}
+
+/*
+ * Make room for `need` elements in `data`, at least doubling it. The
+ * first growth moves it from the inline array `small` to the heap.
+ * Returns the new buffer, or NULL if out of memory.
+ */
+static void *
+_ctx_grow(void *data, size_t *size, const void *small, size_t need, size_t elem)
+{
+	size_t new_size = *size * 2 > need ? *size * 2 : need;
+	void *p;
+
+	polyline_trace(grow, POLYLINE_TRACE_GROW, 0, new_size * elem);
+	if (data == small) {
+		if (!(p = malloc(new_size * elem)))
+			return NULL;
+		memcpy(p, small, *size * elem);
+	} else if (!(p = realloc(data, new_size * elem))) {
+		return NULL;
+	}
+	*size = new_size;
+	return p;
+}
+
+ssize_t
+polyline_ctx_encode(struct polyline_ctx *ctx, const float *coords, size_t n,
+		    const char **rpolyline)
+{
+	uint32_t vals[block_values];
+	size_t idx = 0;
+	polyline_trace_clock(t0);
+	polyline_trace(encode_start, POLYLINE_TRACE_ENCODE_START, 0, n);
+
+	if (!ctx || !coords || !n || !rpolyline) {
+		polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_EINVAL);
+		return POLYLINE_EINVAL;
+	}
+
+	for (size_t i = 0; i < n * 2; i += block_values) {
+		size_t count = n * 2 - i < block_values ? n * 2 - i : block_values;
+		size_t need = idx + count * max_5bit_chunks_decode + 1;
+
+		_encode_deltas(vals, coords, i, count);
+		if (need > ctx->chars_size) {
+			char *chars = _ctx_grow(ctx->chars, &ctx->chars_size,
+						ctx->small_chars, need, 1);
+			if (!chars) {
+				polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_ENOMEM);
+				return POLYLINE_ENOMEM;
+			}
+			ctx->chars = chars;
+		}
+		idx += _encode_chunks(ctx->chars + idx, vals, count);
+	}
+	ctx->chars[idx] = '\0';
+	polyline_trace(encode_end, POLYLINE_TRACE_ENCODE_END, t0, idx);
+	*rpolyline = ctx->chars;
+	return idx;
+}
+
+ssize_t
+polyline_ctx_decode(struct polyline_ctx *ctx, const char *polyline,
+		    const float **rcoords)
+{
+	uint32_t acc[2] = {0, 0};
+	uint32_t vals[block_values];
+	size_t idx = 0;
+	polyline_trace_clock(t0);
+	polyline_trace(decode_start, POLYLINE_TRACE_DECODE_START, 0,
+		       polyline ? strlen(polyline) : 0);
+
+	if (!ctx || !polyline || !rcoords) {
+		polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_EINVAL);
+		return POLYLINE_EINVAL;
+	}
+
+	while (*polyline) {
+		int count = _decode_values(&polyline, vals, block_values);
+		if (count >= 0 && (count & 1))
+			count = POLYLINE_ETRUNC;
+		if (count < 0) {
+			polyline_trace(error, POLYLINE_TRACE_ERROR, t0, count);
+			return count;
+		}
+		if (idx + count > ctx->coords_size) {
+			float *coords = _ctx_grow(ctx->coords, &ctx->coords_size,
+						  ctx->small_coords, idx + count,
+						  sizeof(float));
+			if (!coords) {
+				polyline_trace(error, POLYLINE_TRACE_ERROR, t0, POLYLINE_ENOMEM);
+				return POLYLINE_ENOMEM;
+			}
+			ctx->coords = coords;
+		}
+		_decode_prefix_sum(ctx->coords + idx, vals, count, acc);
+		idx += count;
+	}
+	polyline_trace(decode_end, POLYLINE_TRACE_DECODE_END, t0, idx / 2);
+	*rcoords = ctx->coords;
+	return idx / 2;
+}
+
+
+int
+polyline_set_trace(polyline_trace_fn fn, void *ctx)
+{
+#ifdef POLYLINE_TRACE
+	pthread_mutex_lock(&trace_lock);
+	unsigned seq = __atomic_load_n(&trace_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&trace_fn, fn, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_ctx, ctx, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_seq, seq + 2, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+#else
+	(void)fn;
+	(void)ctx;
+	return POLYLINE_EINVAL;
+#endif
+}
+
+
 /* This needs to be kept in nice order! */
 static const char *error_map[] = {
 	NULL,
@@ -308,6 +1961,8 @@ static const char *error_map[] = {
 	"POLYLINE_EPARSE", /* -3 Failed to decode a polyline. */
 	"POLYLINE_ETRUNC", /* -4 Truncated polyline during decode. */
 	"POLYLINE_ERANGE", /* -5 Coordinates out of range. Allowed is -180.0 to 180.0 */
+	"POLYLINE_ENOSPC", /* -6 Output arrays too small. */
+	"POLYLINE_EIO",    /* -7 File I/O failed, see errno. */
 };
 
 const char *
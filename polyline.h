@@ -6,13 +6,21 @@
  */
 #ifndef __POLYLINE_H__
 #define __POLYLINE_H__
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define POLYLINE_ENOMEM -1 /**< Return value if a memory allocation failed. */
 #define POLYLINE_EINVAL -2 /**< Invalid arguments. */
 #define POLYLINE_EPARSE -3 /**< Failed to decode a polyline. */
 #define POLYLINE_ETRUNC -4 /**< Truncated polyline during decode. */
 #define POLYLINE_ERANGE -5 /**< Coordinates out of range. Allowed is -180.0 to 180.0 */
+#define POLYLINE_ENOSPC -6 /**< Output arrays too small. */
+#define POLYLINE_EIO -7 /**< File I/O failed, see `errno`. */
 
 /**
  * Encode an array of floats to a Google Polyline string.
@@ -58,6 +66,375 @@ int polyline_encode(char **rptr, size_t *rsize, const float *coords, size_t n);
  */
 int polyline_decode(float **rptr, size_t *rsize, const char *polyline);
 
+#define POLYLINE_FLOAT 0 /**< Coordinates as `float` degrees. */
+#define POLYLINE_DOUBLE 1 /**< Coordinates as `double` degrees. */
+#define POLYLINE_INT32 2 /**< Coordinates as `int32_t`, degrees multiplied by 1e5. */
+#define POLYLINE_SOA_ALIGN 64 /**< Recommended alignment of structure-of-arrays buffers. */
+
+/**
+ * Count the coordinates of a Google Polyline without decoding it, e.g.
+ * to size the arrays for @ref polyline_decode_soa().
+ *
+ * @return On success, returns the number of *coordinates*. On error, a
+ * 	value < 0 is returned.
+ */
+int polyline_count(const char *polyline);
+
+/**
+ * Decode a Google Polyline into separate latitude and longitude arrays
+ * provided by the caller.
+ *
+ * Allocating the arrays with `aligned_alloc()` and
+ * @ref POLYLINE_SOA_ALIGN lets downstream code use aligned vector loads.
+ *
+ * @param lat Array of at least `n` elements of the given `type`.
+ * @param lng Array of at least `n` elements of the given `type`.
+ * @param n Capacity of `lat` and `lng` in coordinates.
+ * @param type One of @ref POLYLINE_FLOAT, @ref POLYLINE_DOUBLE or
+ * 	@ref POLYLINE_INT32.
+ * @param polyline C string representing a Google Polyline.
+ *
+ * @return On success, returns the number of *coordinates*. If the arrays
+ * 	are too small, `POLYLINE_ENOSPC` is returned. On error, a value
+ * 	< 0 is returned.
+ */
+int polyline_decode_soa(void *lat, void *lng, size_t n, int type,
+			const char *polyline);
+
+/**
+ * Encode separate latitude and longitude arrays to a Google Polyline
+ * string. `float` input gives the same result as @ref polyline_encode().
+ *
+ * @param rptr Pointer to a `char*` which will be assigned an
+ * 	allocated C string. Same semantics as for @ref polyline_encode().
+ * @param rsize Size of array provided or allocated.
+ * @param lat Array of `n` latitudes of the given `type`.
+ * @param lng Array of `n` longitudes of the given `type`.
+ * @param n Number of coordinates to be encoded.
+ * @param type One of @ref POLYLINE_FLOAT, @ref POLYLINE_DOUBLE or
+ * 	@ref POLYLINE_INT32.
+ *
+ * @return On success, returns the length (`strlen()`) of the C string
+ *         assigned to `*rptr`. On error, a value < 0 is returned.
+ */
+int polyline_encode_soa(char **rptr, size_t *rsize, const void *lat,
+			const void *lng, size_t n, int type);
+
+/**
+ * Decode a single, very large Google Polyline using multiple threads.
+ *
+ * The string is split into chunks at value boundaries which are decoded
+ * concurrently. Arguments and buffer handling are the same as for
+ * @ref polyline_decode(), and so are the results. Short inputs use
+ * fewer threads than requested, and no call uses more than 64.
+ *
+ * @param nthreads Maximum number of threads to use, including the
+ * 	calling thread. Must be at least 1; larger values than 64 are
+ * 	capped.
+ *
+ * @return On success, returns the number of *coordinates*. On error, a
+ * 	value < 0 is returned.
+ */
+int polyline_decode_parallel(float **rptr, size_t *rsize, const char *polyline,
+			     int nthreads);
+
+struct polyline_ctx;
+
+/**
+ * Create a context for repeated encoding and decoding. The context owns
+ * the output buffers and reuses them across calls. Polylines of up to 64
+ * points fit into buffers within the context, so short-lived contexts do
+ * not allocate for them either.
+ *
+ * Encoding and decoding run the same code as @ref polyline_encode() and
+ * @ref polyline_decode() and are not faster than those with a reused
+ * buffer. The context saves the caller from managing `rptr` and `rsize`
+ * and returns `ssize_t` results.
+ *
+ * A context must not be used by multiple threads concurrently, use one
+ * per thread instead.
+ *
+ * @return 0 on success. On error, a value < 0 is returned.
+ */
+int polyline_ctx_create(struct polyline_ctx **rctx);
+
+/**
+ * Free the context and its buffers.
+ */
+void polyline_ctx_destroy(struct polyline_ctx *ctx);
+
+/**
+ * Same as @ref polyline_encode(), with the result in the context.
+ *
+ * @param rpolyline Set to the C string, owned by the context and valid
+ * 	until the next call using it.
+ *
+ * @return On success, returns the length (`strlen()`) of the C string,
+ * 	which may exceed `INT_MAX`. On error, a value < 0 is returned.
+ */
+ssize_t polyline_ctx_encode(struct polyline_ctx *ctx, const float *coords,
+			    size_t n, const char **rpolyline);
+
+/**
+ * Same as @ref polyline_decode(), with the result in the context.
+ *
+ * @param rcoords Set to the interleaved coordinates, owned by the context
+ * 	and valid until the next call using it.
+ *
+ * @return On success, returns the number of *coordinates*, which may
+ * 	exceed `INT_MAX`. On error, a value < 0 is returned.
+ */
+ssize_t polyline_ctx_decode(struct polyline_ctx *ctx, const char *polyline,
+			    const float **rcoords);
+
+#define POLYLINE_ND_VERSION 1 /**< Header version of N-dimensional polylines. */
+#define POLYLINE_ND_MAX_DIMS 8 /**< Maximum number of dimensions per point. */
+#define POLYLINE_ND_MAX_PRECISION 15 /**< Maximum decimal precision of a dimension. */
+
+/**
+ * Encode an N-dimensional polyline, e.g. latitude, longitude, elevation
+ * and timestamp, with an individual decimal precision per dimension.
+ *
+ * The resulting string starts with a header holding the format version,
+ * the number of dimensions and their precisions, followed by the deltas
+ * of all dimensions interleaved point by point. It is not compatible
+ * with @ref polyline_decode().
+ *
+ * @param rptr Pointer to a `char*` which will be assigned an
+ * 	allocated C string. Same semantics as for @ref polyline_encode().
+ * @param rsize Size of array provided or allocated.
+ * @param coords Pointer to `dims * n` doubles in structure-of-arrays
+ * 	layout: value `d` of point `i` is found at `coords[d * n + i]`.
+ * @param n Number of points to be encoded.
+ * @param dims Number of dimensions, 1 to @ref POLYLINE_ND_MAX_DIMS.
+ * @param precision Array of `dims` decimal precisions, each from 0 to
+ * 	@ref POLYLINE_ND_MAX_PRECISION. Google Polyline uses 5.
+ *
+ * @return On success, returns the length (`strlen()`) of the C string
+ *         assigned to `*rptr`. On error, a value < 0 is returned.
+ */
+int polyline_encode_nd(char **rptr, size_t *rsize, const double *coords,
+		       size_t n, int dims, const int *precision);
+
+/**
+ * Decode an N-dimensional polyline created by @ref polyline_encode_nd().
+ *
+ * All dimensions are decoded in a single pass into one buffer in
+ * structure-of-arrays layout: with `n` being the return value, value `d`
+ * of point `i` is stored at `(*rptr)[d * n + i]`. Buffer handling is
+ * the same as for @ref polyline_decode().
+ *
+ * @param rptr Pointer to an array of doubles for the result.
+ * @param rsize Size of array provided or allocated, in elements.
+ * @param rdims Set to the number of dimensions found in the header.
+ * @param rprecision Array of at least @ref POLYLINE_ND_MAX_DIMS elements,
+ * 	set to the precision of each dimension. May be NULL.
+ * @param polyline C string representing an N-dimensional polyline.
+ *
+ * @return On success, returns the number of *points*. On error, a value
+ * 	< 0 is returned.
+ */
+int polyline_decode_nd(double **rptr, size_t *rsize, int *rdims,
+		       int *rprecision, const char *polyline);
+
+/**
+ * Transcode a polyline from one precision to another, e.g. from 5 as used
+ * by Google to 6 as used by OSRM, without going through floats.
+ *
+ * Works in a single streaming pass over the input and never allocates
+ * a coordinate array. When reducing precision, positions are rounded
+ * half away from zero, same as @ref polyline_encode().
+ *
+ * Above precision 7, values can take more than the 7 characters that
+ * @ref polyline_decode(), @ref polyline_count() and
+ * @ref polyline_decode_soa() accept. Such output is only readable by
+ * this function and @ref polyline_decode_nd().
+ *
+ * @param rptr Pointer to a `char*` which will be assigned an
+ * 	allocated C string. Same semantics as for @ref polyline_encode().
+ * @param rsize Size of array provided or allocated.
+ * @param polyline C string representing a polyline with `src_precision`.
+ * @param src_precision Decimal precision of the input, 0 to
+ * 	@ref POLYLINE_ND_MAX_PRECISION.
+ * @param dst_precision Decimal precision of the output, 0 to
+ * 	@ref POLYLINE_ND_MAX_PRECISION.
+ *
+ * @return On success, returns the length (`strlen()`) of the C string
+ *         assigned to `*rptr`. On error, a value < 0 is returned.
+ *         `POLYLINE_ERANGE` is returned if a position does not fit in
+ *         64 bits at `dst_precision`.
+ */
+int polyline_transcode(char **rptr, size_t *rsize, const char *polyline,
+		       int src_precision, int dst_precision);
+
+#define POLYLINE_DOD_VERSION 2 /**< Header version of delta of delta polylines, distinct from @ref POLYLINE_ND_VERSION. */
+
+/**
+ * Encode coordinates as a delta of delta polyline.
+ *
+ * After a header, the body uses the alphabet and chunking of Google
+ * Polyline, but holds the differences between consecutive deltas. For
+ * traces sampled at a steady rate at nearly constant speed these are
+ * tiny, which makes the result much shorter than with
+ * @ref polyline_encode(). Positions are quantized exactly as
+ * @ref polyline_encode() does, so @ref polyline_dod_to_polyline() yields
+ * the same string.
+ *
+ * Parameters and return value are the same as for @ref polyline_encode().
+ */
+int polyline_encode_dod(char **rptr, size_t *rsize, const float *coords, size_t n);
+
+/**
+ * Decode a delta of delta polyline. Parameters and return value are the
+ * same as for @ref polyline_decode(). `POLYLINE_EPARSE` is returned for
+ * a missing or wrong header.
+ */
+int polyline_decode_dod(float **rptr, size_t *rsize, const char *polyline);
+
+/**
+ * Convert a Google Polyline to a delta of delta polyline, in a single
+ * streaming pass without going through coordinates. Buffer handling and
+ * return value are the same as for @ref polyline_transcode().
+ */
+int polyline_dod_from_polyline(char **rptr, size_t *rsize, const char *polyline);
+
+/**
+ * Convert a delta of delta polyline to a Google Polyline, in a single
+ * streaming pass without going through coordinates. Buffer handling and
+ * return value are the same as for @ref polyline_transcode().
+ */
+int polyline_dod_to_polyline(char **rptr, size_t *rsize, const char *polyline);
+
+/**
+ * Hausdorff distance between two polylines: the largest distance from a
+ * point of either one to the closest point of the other.
+ *
+ * Distances are planar, in degrees, computed on the integer positions.
+ * Both polylines are decoded in blocks and `b` is decoded again for each
+ * block of `a`, so memory use is constant. Computation stops as soon as
+ * the distance is known to exceed `threshold`.
+ *
+ * @param rdist Set to the distance. After an early exit, set to a lower
+ * 	bound above `threshold`.
+ * @param a C string representing a Google Polyline.
+ * @param b C string representing a Google Polyline.
+ * @param threshold Stop once the distance exceeds this. Pass `INFINITY`
+ * 	to always compute the exact distance. Negative values and NaN are
+ * 	invalid.
+ *
+ * @return 0 if `*rdist` is the distance, 1 on an early exit. On error,
+ * 	including empty polylines, a value < 0 is returned.
+ */
+int polyline_hausdorff(double *rdist, const char *a, const char *b, double threshold);
+
+/**
+ * Discrete Fréchet distance between two polylines: the shortest leash
+ * needed to walk both in order, point by point.
+ *
+ * Same units and semantics as @ref polyline_hausdorff(). `a` is streamed,
+ * while the positions of `b` and one row of distances are allocated on
+ * the heap, so memory use is O(m) for `m` points of `b`: 16 bytes each.
+ * The early exit happens after the first point of `a` for which every
+ * partial walk already exceeds `threshold`.
+ *
+ * @return 0 if `*rdist` is the distance, 1 on an early exit. On error,
+ * 	including empty polylines, a value < 0 is returned.
+ */
+int polyline_frechet(double *rdist, const char *a, const char *b, double threshold);
+
+/**
+ * Count the leading points of two polylines which are at most
+ * `tolerance` degrees apart. Pass 0 for identical points. Negative
+ * values and NaN are invalid.
+ *
+ * Decoding stops at the first differing point, errors after it go
+ * unnoticed.
+ *
+ * @return On success, returns the number of shared points. On error,
+ * 	a value < 0 is returned.
+ */
+int polyline_shared_prefix(const char *a, const char *b, double tolerance);
+
+/**
+ * Bounding box in units of 1e-5 degrees, inclusive.
+ */
+struct polyline_bbox {
+	int32_t min_lat;
+	int32_t min_lng;
+	int32_t max_lat;
+	int32_t max_lng;
+};
+
+/**
+ * Callback for @ref polyline_clip(). `polyline` is a C string of `len`
+ * bytes and only valid during the call. Return 0 to continue, anything
+ * else to stop clipping.
+ */
+typedef int (*polyline_clip_fn)(const char *polyline, size_t len, void *ctx);
+
+/**
+ * Clip a polyline to a bounding box and pass every run inside of it to
+ * `fn` as a newly encoded polyline.
+ *
+ * Runs start and end where the polyline crosses the box, with crossing
+ * points rounded to the nearest position on the edge. Runs only touching
+ * the box in a single point are dropped. Decoding, clipping and encoding
+ * happen in a single streaming pass with integer arithmetic.
+ *
+ * @param polyline C string representing a Google Polyline.
+ * @param bbox The box. Its bounds must be within +-2^30.
+ * @param fn Called once per run.
+ * @param ctx Passed to `fn`.
+ *
+ * @return On success, returns the number of runs passed to `fn`. On error,
+ * 	a value < 0 is returned. `POLYLINE_ERANGE` is returned for
+ * 	positions beyond +-2^30 crossing the box.
+ */
+int polyline_clip(const char *polyline, const struct polyline_bbox *bbox,
+		  polyline_clip_fn fn, void *ctx);
+
+#define POLYLINE_TRACE_ENCODE_START 1 /**< polyline_encode() or polyline_ctx_encode() called, `arg` is the number of coordinates. */
+#define POLYLINE_TRACE_ENCODE_END 2 /**< polyline_encode() or polyline_ctx_encode() succeeded, `arg` is the string length. */
+#define POLYLINE_TRACE_DECODE_START 3 /**< polyline_decode() or polyline_ctx_decode() called, `arg` is the string length. */
+#define POLYLINE_TRACE_DECODE_END 4 /**< polyline_decode() or polyline_ctx_decode() succeeded, `arg` is the number of coordinates. */
+#define POLYLINE_TRACE_GROW 5 /**< Result buffer grown, `arg` is the new size in bytes. */
+#define POLYLINE_TRACE_ERROR 6 /**< Encode or decode failed, `arg` is the error code. */
+
+/**
+ * A trace event passed to the callback set with @ref polyline_set_trace().
+ */
+struct polyline_trace_event {
+	int point;              /**< One of the `POLYLINE_TRACE_*` points. */
+	uint64_t ticks;         /**< TSC on x86, otherwise monotonic nanoseconds. */
+	uint64_t elapsed;       /**< Ticks since the start event, for end and error events. */
+	int64_t arg;            /**< Depends on `point`. */
+};
+
+/**
+ * Trace callback. Called synchronously from the thread doing the work.
+ */
+typedef void (*polyline_trace_fn)(const struct polyline_trace_event *ev, void *ctx);
+
+/**
+ * Register a callback for the trace points of @ref polyline_encode(),
+ * @ref polyline_decode() and their @ref polyline_ctx_encode() and
+ * @ref polyline_ctx_decode() counterparts. Pass NULL to unregister.
+ *
+ * May be called while other threads encode or decode. Each event goes
+ * to a callback together with the `ctx` it was registered with. Events
+ * of calls already running may still reach the previous callback after
+ * this returns, so its `ctx` must stay valid until they have finished.
+ *
+ * Trace points only exist if the library was compiled with
+ * `-DPOLYLINE_TRACE`, otherwise they compile to nothing. With
+ * `<sys/sdt.h>` available, they are also USDT probes of the `polyline`
+ * provider for SystemTap, bpftrace or perf.
+ *
+ * @return 0 on success, `POLYLINE_EINVAL` if the library was compiled
+ * 	without trace points.
+ */
+int polyline_set_trace(polyline_trace_fn fn, void *ctx);
+
 /**
  * Return a pointer to a string that describes the error code.
  *
@@ -68,4 +445,8 @@ int polyline_decode(float **rptr, size_t *rsize, const char *polyline);
  * 	the error code does not exist.
  */
 const char *polyline_strerror(int error);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
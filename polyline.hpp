@@ -0,0 +1,335 @@
+/**
+ * @file
+ * Header-only C++17 API for Google Polyline encoding and decoding.
+ *
+ * Decoding happens lazily through @ref polyline::view iterators, without
+ * allocating. Precision and coordinate type are template parameters, so
+ * the multiplier is a compile time constant. Encoding appends to any
+ * output iterator or `std::string` and can run in a `constexpr` context.
+ *
+ * Coordinates are quantized before taking deltas, as in Google's
+ * reference algorithm. polyline_encode() instead quantizes the float
+ * deltas, so the two encoders can differ by one in the last digit of a
+ * value: the reference example ends in `_mqNvxq`@` here and in
+ * `_mqNxxq`@` with polyline_encode(). Decoding accepts the same strings
+ * as polyline_decode().
+ */
+#ifndef __POLYLINE_HPP__
+#define __POLYLINE_HPP__
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include "polyline.h"
+
+namespace polyline {
+
+/**
+ * A decoded coordinate.
+ */
+template <typename T = float>
+struct point {
+	T lat;
+	T lng;
+
+	constexpr bool operator==(const point &o) const { return lat == o.lat && lng == o.lng; }
+	constexpr bool operator!=(const point &o) const { return !(*this == o); }
+};
+
+namespace detail {
+
+/* Characters per value accepted by polyline_decode(). */
+constexpr int max_chunks = 7;
+
+template <typename T>
+constexpr T
+pow10(int precision)
+{
+	T r = 1;
+	for (int i = 0; i < precision; i++)
+		r *= 10;
+	return r;
+}
+
+/* Away from zero at .5 like polyline_encode(), but on absolute positions. */
+template <typename T>
+constexpr std::int64_t
+quantize(T v, T multiplier)
+{
+	T s = v * multiplier;
+	return s < 0 ? -static_cast<std::int64_t>(-s + T(0.5))
+		     : static_cast<std::int64_t>(s + T(0.5));
+}
+
+template <typename OutputIt>
+constexpr OutputIt
+put_value(std::int64_t delta, OutputIt out)
+{
+	std::uint64_t val = (static_cast<std::uint64_t>(delta) << 1) ^
+			    static_cast<std::uint64_t>(delta >> 63);
+	do {
+		char chunk = static_cast<char>(val & 0x1f);
+		val >>= 5;
+		if (val)
+			chunk |= 0x20;
+		*out++ = static_cast<char>(chunk + 63);
+	} while (val);
+	return out;
+}
+
+/*
+ * Read one value starting at `p`, with the same limits and 32-bit
+ * arithmetic as polyline_decode(). Returns the position after the value,
+ * or nullptr on invalid or truncated input.
+ */
+constexpr const char *
+get_value(const char *p, const char *end, std::int64_t &rval)
+{
+	std::uint32_t val = 0;
+	for (int i = 0; p < end && i < max_chunks; i++) {
+		unsigned char c = static_cast<unsigned char>(*p++);
+		if (c < 0x3f || c > 0x7e)
+			return nullptr;
+		c -= 0x3f;
+		val |= static_cast<std::uint32_t>(c & 0x1f) << (i * 5);
+		if (!(c & 0x20)) {
+			rval = static_cast<std::int32_t>((val >> 1) ^ -(val & 1));
+			return p;
+		}
+	}
+	return nullptr;
+}
+
+} /* namespace detail */
+
+/**
+ * Lazy, non-owning view over an encoded polyline.
+ *
+ * Iterating decodes one coordinate at a time. Iteration stops at the
+ * first malformed or truncated coordinate; use validate() to tell this
+ * apart from the regular end of the string.
+ *
+ * @tparam Precision Decimal precision, 5 for Google Polyline, 6 for OSRM.
+ * @tparam T Coordinate type, `float` or `double`.
+ */
+template <int Precision = 5, typename T = float>
+class view {
+public:
+	/** Compile time multiplier for this precision. */
+	static constexpr T multiplier = detail::pow10<T>(Precision);
+
+	using value_type = point<T>;
+
+	/** Forward iterator yielding `point<T>` values. */
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = point<T>;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const point<T> *;
+		using reference = const point<T> &;
+
+		constexpr iterator() = default;
+		constexpr iterator(const char *pos, const char *end)
+			: pos_(pos), end_(end) { decode(); }
+
+		constexpr reference operator*() const { return cur_; }
+		constexpr pointer operator->() const { return &cur_; }
+
+		constexpr iterator &
+		operator++()
+		{
+			pos_ = next_;
+			decode();
+			return *this;
+		}
+
+		constexpr iterator
+		operator++(int)
+		{
+			iterator tmp = *this;
+			++*this;
+			return tmp;
+		}
+
+		constexpr bool operator==(const iterator &o) const { return pos_ == o.pos_; }
+		constexpr bool operator!=(const iterator &o) const { return pos_ != o.pos_; }
+
+	private:
+		constexpr void
+		decode()
+		{
+			std::int64_t dlat = 0, dlng = 0;
+			const char *p = pos_ == end_ ? nullptr
+				      : detail::get_value(pos_, end_, dlat);
+			if (p)
+				p = detail::get_value(p, end_, dlng);
+			if (!p) {
+				pos_ = next_ = end_;
+				return;
+			}
+			next_ = p;
+			lat_ += dlat;
+			lng_ += dlng;
+			cur_ = {static_cast<T>(lat_) / multiplier,
+				static_cast<T>(lng_) / multiplier};
+		}
+
+		const char *pos_ = nullptr;
+		const char *next_ = nullptr;
+		const char *end_ = nullptr;
+		std::int64_t lat_ = 0, lng_ = 0;
+		point<T> cur_ = {};
+	};
+
+	using const_iterator = iterator;
+
+	constexpr view() = default;
+	constexpr explicit view(std::string_view polyline) : s_(polyline) {}
+
+	constexpr iterator begin() const { return iterator(s_.data(), s_.data() + s_.size()); }
+	constexpr iterator end() const { const char *e = s_.data() + s_.size(); return iterator(e, e); }
+	constexpr bool empty() const { return s_.empty(); }
+
+	/**
+	 * Number of coordinates, without decoding them. Only meaningful
+	 * if validate() returns 0.
+	 */
+	constexpr std::size_t
+	size() const
+	{
+		std::size_t terminals = 0;
+		for (char c : s_)
+			terminals += (static_cast<unsigned char>(c) < 0x5f);
+		return terminals / 2;
+	}
+
+	/**
+	 * Check the whole string.
+	 *
+	 * @return 0 if valid, otherwise `POLYLINE_EPARSE` or `POLYLINE_ETRUNC`
+	 * 	as for polyline_decode().
+	 */
+	constexpr int
+	validate() const
+	{
+		int values = 0, chunk_idx = 0;
+		for (char ch : s_) {
+			unsigned char c = static_cast<unsigned char>(ch);
+			if (c < 0x3f || c > 0x7e || chunk_idx >= detail::max_chunks)
+				return POLYLINE_EPARSE;
+			if (c < 0x5f) {
+				values ^= 1;
+				chunk_idx = 0;
+			} else {
+				chunk_idx++;
+			}
+		}
+		return (values || chunk_idx) ? POLYLINE_ETRUNC : 0;
+	}
+
+	constexpr std::string_view str() const { return s_; }
+
+private:
+	std::string_view s_;
+};
+
+/**
+ * Encode the coordinates in `[first, last)` and write the characters to
+ * `out`. The value type must have `lat` and `lng` members.
+ *
+ * @return The output iterator past the last written character.
+ */
+template <int Precision = 5, typename InputIt, typename OutputIt>
+constexpr OutputIt
+encode(InputIt first, InputIt last, OutputIt out)
+{
+	using T = decltype(first->lat);
+	constexpr T multiplier = detail::pow10<T>(Precision);
+	std::int64_t lat_prev = 0, lng_prev = 0;
+	for (; first != last; ++first) {
+		std::int64_t lat = detail::quantize<T>(first->lat, multiplier);
+		std::int64_t lng = detail::quantize<T>(first->lng, multiplier);
+		out = detail::put_value(lat - lat_prev, out);
+		out = detail::put_value(lng - lng_prev, out);
+		lat_prev = lat;
+		lng_prev = lng;
+	}
+	return out;
+}
+
+/**
+ * Encode a range of coordinates, appending to `dst`.
+ */
+template <int Precision = 5, typename Range>
+void
+encode(const Range &coords, std::string &dst)
+{
+	encode<Precision>(std::begin(coords), std::end(coords), std::back_inserter(dst));
+}
+
+/**
+ * Encode a range of coordinates into a new string.
+ */
+template <int Precision = 5, typename Range>
+std::string
+encode(const Range &coords)
+{
+	std::string dst;
+	encode<Precision>(coords, dst);
+	return dst;
+}
+
+/**
+ * Fixed capacity string returned by the `constexpr` encoder.
+ */
+template <std::size_t Capacity>
+struct literal {
+	char data[Capacity + 1] = {};
+	std::size_t size = 0;
+
+	constexpr std::string_view str() const { return std::string_view(data, size); }
+	constexpr const char *c_str() const { return data; }
+};
+
+namespace detail {
+
+template <std::size_t Capacity>
+struct literal_inserter {
+	literal<Capacity> *l;
+
+	constexpr literal_inserter &operator*() { return *this; }
+	constexpr literal_inserter &operator++() { return *this; }
+	constexpr literal_inserter operator++(int) { return *this; }
+	constexpr literal_inserter &
+	operator=(char c)
+	{
+		l->data[l->size++] = c;
+		return *this;
+	}
+};
+
+} /* namespace detail */
+
+/**
+ * Encode an array of coordinates at compile time:
+ *
+ *     constexpr polyline::point<double> pts[] = {{38.5, -120.2}, {40.7, -120.95}};
+ *     constexpr auto encoded = polyline::encode_literal(pts);
+ *     static_assert(encoded.str() == "_p~iF~ps|U_ulLnnqC");
+ *
+ * Each value takes at most 13 characters, which bounds the capacity.
+ */
+template <int Precision = 5, typename P, std::size_t N>
+constexpr literal<N * 2 * 13>
+encode_literal(const P (&coords)[N])
+{
+	literal<N * 2 * 13> l;
+	encode<Precision>(coords, coords + N, detail::literal_inserter<N * 2 * 13>{&l});
+	return l;
+}
+
+} /* namespace polyline */
+#endif
@@ -0,0 +1,209 @@
+/*
+ * Bounded LRU cache of decoded polylines.
+ *
+ * A chained hash table finds entries, a doubly linked list ordered by
+ * last use picks the one to evict.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "polyline_cache.h"
+#include "polyline_internal.h"
+
+struct entry {
+	uint64_t hash;
+	struct entry *next;     /* bucket chain */
+	struct entry *prev_lru;
+	struct entry *next_lru;
+	float *coords;
+	size_t coords_size;
+	int n;
+	char *extra;
+	size_t extra_len;
+	size_t key_len;
+	char key[];
+};
+
+struct polyline_cache {
+	struct entry **buckets;
+	size_t mask;
+	struct entry *head;     /* most recently used */
+	struct entry *tail;     /* least recently used */
+	struct polyline_cache_stats stats;
+};
+
+int
+polyline_cache_create(struct polyline_cache **rcache, size_t capacity)
+{
+	struct polyline_cache *cache;
+	size_t buckets = 1;
+
+	/* Keeps the bucket count below from overflowing. */
+	if (!rcache || !capacity || capacity > SIZE_MAX / 4)
+		return POLYLINE_EINVAL;
+	while (buckets < capacity * 2)
+		buckets <<= 1;
+
+	if (!(cache = calloc(1, sizeof(*cache))))
+		return POLYLINE_ENOMEM;
+	if (!(cache->buckets = calloc(buckets, sizeof(*cache->buckets)))) {
+		free(cache);
+		return POLYLINE_ENOMEM;
+	}
+	cache->mask = buckets - 1;
+	cache->stats.capacity = capacity;
+	*rcache = cache;
+	return 0;
+}
+
+static void
+_free_entry(struct entry *e)
+{
+	free(e->coords);
+	free(e->extra);
+	free(e);
+}
+
+void
+polyline_cache_destroy(struct polyline_cache *cache)
+{
+	if (!cache)
+		return;
+	for (struct entry *e = cache->head, *next; e; e = next) {
+		next = e->next_lru;
+		_free_entry(e);
+	}
+	free(cache->buckets);
+	free(cache);
+}
+
+static void
+_lru_unlink(struct polyline_cache *cache, struct entry *e)
+{
+	if (e->prev_lru)
+		e->prev_lru->next_lru = e->next_lru;
+	else
+		cache->head = e->next_lru;
+	if (e->next_lru)
+		e->next_lru->prev_lru = e->prev_lru;
+	else
+		cache->tail = e->prev_lru;
+}
+
+static void
+_lru_push(struct polyline_cache *cache, struct entry *e)
+{
+	e->prev_lru = NULL;
+	e->next_lru = cache->head;
+	if (cache->head)
+		cache->head->prev_lru = e;
+	else
+		cache->tail = e;
+	cache->head = e;
+}
+
+static struct entry *
+_find(const struct polyline_cache *cache, const char *key, size_t len, uint64_t hash)
+{
+	for (struct entry *e = cache->buckets[hash & cache->mask]; e; e = e->next) {
+		if (e->hash == hash && e->key_len == len && !memcmp(e->key, key, len))
+			return e;
+	}
+	return NULL;
+}
+
+static void
+_evict(struct polyline_cache *cache)
+{
+	struct entry *e = cache->tail, **pp;
+
+	_lru_unlink(cache, e);
+	for (pp = &cache->buckets[e->hash & cache->mask]; *pp != e; pp = &(*pp)->next)
+		;
+	*pp = e->next;
+	_free_entry(e);
+	cache->stats.entries--;
+	cache->stats.evictions++;
+}
+
+int
+polyline_cache_decode(struct polyline_cache *cache, const char *polyline,
+		      const float **rcoords, const char **rextra,
+		      size_t *rextra_len)
+{
+	struct entry *e;
+	size_t len;
+	uint64_t hash;
+
+	if (!cache || !polyline || !rcoords)
+		return POLYLINE_EINVAL;
+
+	len = strlen(polyline);
+	hash = _hash_bytes(len, polyline, len);
+	if ((e = _find(cache, polyline, len, hash))) {
+		cache->stats.hits++;
+		_lru_unlink(cache, e);
+		_lru_push(cache, e);
+	} else {
+		cache->stats.misses++;
+		if (!(e = calloc(1, sizeof(*e) + len + 1)))
+			return POLYLINE_ENOMEM;
+		e->n = polyline_decode(&e->coords, &e->coords_size, polyline);
+		if (e->n < 0) {
+			int r = e->n;
+			_free_entry(e);
+			return r;
+		}
+		if (cache->stats.entries >= cache->stats.capacity)
+			_evict(cache);
+
+		e->hash = hash;
+		e->key_len = len;
+		memcpy(e->key, polyline, len + 1);
+		e->next = cache->buckets[hash & cache->mask];
+		cache->buckets[hash & cache->mask] = e;
+		_lru_push(cache, e);
+		cache->stats.entries++;
+	}
+
+	*rcoords = e->coords;
+	if (rextra)
+		*rextra = e->extra;
+	if (rextra_len)
+		*rextra_len = e->extra_len;
+	return e->n;
+}
+
+int
+polyline_cache_set_extra(struct polyline_cache *cache, const char *polyline,
+			 const char *extra, size_t extra_len)
+{
+	struct entry *e;
+	size_t len;
+	char *copy;
+
+	if (!cache || !polyline || (!extra && extra_len))
+		return POLYLINE_EINVAL;
+
+	len = strlen(polyline);
+	if (!(e = _find(cache, polyline, len, _hash_bytes(len, polyline, len))))
+		return POLYLINE_EINVAL;
+
+	if (!(copy = malloc(extra_len + 1)))
+		return POLYLINE_ENOMEM;
+	if (extra_len)
+		memcpy(copy, extra, extra_len);
+	copy[extra_len] = '\0';
+	free(e->extra);
+	e->extra = copy;
+	e->extra_len = extra_len;
+	return 0;
+}
+
+void
+polyline_cache_stats(const struct polyline_cache *cache,
+		     struct polyline_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file
+ * Bounded LRU cache of decoded polylines.
+ *
+ * Entries are keyed by the polyline bytes, looked up through a fast
+ * 64-bit hash. Besides the coordinates, an entry can carry extra bytes
+ * derived from them, such as a formatted output line.
+ */
+#ifndef __POLYLINE_CACHE_H__
+#define __POLYLINE_CACHE_H__
+#include <stdint.h>
+
+#include "polyline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Cache statistics, see @ref polyline_cache_stats().
+ */
+struct polyline_cache_stats {
+	size_t hits;            /**< Lookups served from the cache. */
+	size_t misses;          /**< Lookups that had to decode. */
+	size_t evictions;       /**< Entries dropped to stay within capacity. */
+	size_t entries;         /**< Entries currently cached. */
+	size_t capacity;        /**< Maximum number of entries. */
+};
+
+struct polyline_cache;
+
+/**
+ * Create a cache holding up to `capacity` decoded polylines.
+ *
+ * @return 0 on success. On error, a value < 0 is returned, including
+ * 	POLYLINE_EINVAL for a `capacity` of 0 or above `SIZE_MAX / 4`.
+ */
+int polyline_cache_create(struct polyline_cache **rcache, size_t capacity);
+
+/**
+ * Free the cache and all its entries.
+ */
+void polyline_cache_destroy(struct polyline_cache *cache);
+
+/**
+ * Decode a polyline through the cache. On a hit, no decoding happens.
+ * Polylines failing to decode are not cached.
+ *
+ * @param cache The cache.
+ * @param polyline C string representing a Google Polyline.
+ * @param rcoords Set to the decoded coordinates, interleaved as with
+ * 	@ref polyline_decode(). Owned by the cache and valid until the
+ * 	next call of polyline_cache_decode().
+ * @param rextra If not NULL, set to the extra bytes attached with
+ * 	@ref polyline_cache_set_extra(), or NULL if there are none.
+ * @param rextra_len If not NULL, set to the length of the extra bytes.
+ *
+ * @return On success, returns the number of *coordinates*. On error, a
+ * 	value < 0 is returned.
+ */
+int polyline_cache_decode(struct polyline_cache *cache, const char *polyline,
+			  const float **rcoords, const char **rextra,
+			  size_t *rextra_len);
+
+/**
+ * Attach a copy of `extra` to the cache entry of `polyline`, replacing
+ * previous extra bytes.
+ *
+ * @return 0 on success, `POLYLINE_EINVAL` if `polyline` is not cached.
+ * 	On error, a value < 0 is returned.
+ */
+int polyline_cache_set_extra(struct polyline_cache *cache, const char *polyline,
+			     const char *extra, size_t extra_len);
+
+/**
+ * Fill `stats` with the current statistics of `cache`.
+ */
+void polyline_cache_stats(const struct polyline_cache *cache,
+			  struct polyline_cache_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Helpers shared by the library sources, not part of the API.
+ *
+ * Anything parsing or writing polyline characters outside of polyline.c
+ * uses these, so its limits cannot drift from the decoder's.
+ */
+#ifndef __POLYLINE_INTERNAL_H__
+#define __POLYLINE_INTERNAL_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Characters per 2D value: 35 bits, the most a uint32_t takes. */
+static const int max_5bit_chunks_decode = 7;
+
+/*
+ * Split the zigzag encoded `val` into 5-bit chunks, set 0x20 if more
+ * chunks follow and add 63. Writes at most `max_5bit_chunks_decode`
+ * bytes to `dst` and returns the number written.
+ */
+static inline size_t
+_encode_value(char *dst, uint32_t val)
+{
+	char *p = dst;
+	while (val >= 0x20) {
+		*p++ = (char)((0x20 | (val & 0x1f)) + 63);
+		val >>= 5;
+	}
+	*p++ = (char)(val + 63);
+	return p - dst;
+}
+
+/*
+ * Hash `len` bytes 8 at a time with a multiply-xorshift mix, starting
+ * from `seed`.
+ */
+static inline uint64_t
+_hash_bytes(uint64_t seed, const char *bytes, size_t len)
+{
+	const uint64_t m = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = seed * m;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, bytes + i, 8);
+		h = (h ^ w) * m;
+		h ^= h >> 29;
+	}
+	if (i < len) {
+		uint64_t w = 0;
+		memcpy(&w, bytes + i, len - i);
+		h = (h ^ w) * m;
+		h ^= h >> 29;
+	}
+	h *= m;
+	return h ^ (h >> 32);
+}
+#endif
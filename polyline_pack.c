@@ -0,0 +1,266 @@
+/*
+ * Memory-mapped polyline pack files.
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "polyline_pack.h"
+
+struct polyline_pack_writer {
+	FILE *f;
+	uint64_t offset;
+	struct polyline_pack_entry *entries;
+	size_t count;
+	size_t size;
+	int32_t *lat;
+	int32_t *lng;
+	size_t coords_size;
+	int error;
+};
+
+struct polyline_pack {
+	const char *data;
+	size_t length;
+	const struct polyline_pack_entry *index;
+	size_t count;
+};
+
+int
+polyline_pack_writer_open(struct polyline_pack_writer **rwriter, const char *path)
+{
+	struct polyline_pack_header header = {
+		.magic = POLYLINE_PACK_MAGIC,
+	};
+	struct polyline_pack_writer *w;
+
+	if (!rwriter || !path)
+		return POLYLINE_EINVAL;
+	if (!(w = calloc(1, sizeof(*w))))
+		return POLYLINE_ENOMEM;
+	if (!(w->f = fopen(path, "wb"))) {
+		free(w);
+		return POLYLINE_EIO;
+	}
+	/* Placeholder, the real header is written on close. */
+	if (fwrite(&header, sizeof(header), 1, w->f) != 1) {
+		fclose(w->f);
+		free(w);
+		return POLYLINE_EIO;
+	}
+	w->offset = sizeof(header);
+	*rwriter = w;
+	return 0;
+}
+
+/*
+ * Decode to int32 positions and compute the index entry.
+ */
+static int
+_pack_entry(struct polyline_pack_writer *w, struct polyline_pack_entry *e,
+	    const char *polyline)
+{
+	int n = polyline_count(polyline);
+	if (n < 0)
+		return n;
+
+	if ((size_t)n > w->coords_size) {
+		int32_t *lat = realloc(w->lat, n * sizeof(int32_t));
+		if (lat)
+			w->lat = lat;
+		int32_t *lng = realloc(w->lng, n * sizeof(int32_t));
+		if (lng)
+			w->lng = lng;
+		if (!lat || !lng)
+			return POLYLINE_ENOMEM;
+		w->coords_size = n;
+	}
+	if ((n = polyline_decode_soa(w->lat, w->lng, n, POLYLINE_INT32, polyline)) < 0)
+		return n;
+
+	memset(e, 0, sizeof(*e));
+	e->coords = n;
+	if (n) {
+		e->min_lat = e->max_lat = w->lat[0];
+		e->min_lng = e->max_lng = w->lng[0];
+	}
+	for (int i = 1; i < n; i++) {
+		e->min_lat = w->lat[i] < e->min_lat ? w->lat[i] : e->min_lat;
+		e->max_lat = w->lat[i] > e->max_lat ? w->lat[i] : e->max_lat;
+		e->min_lng = w->lng[i] < e->min_lng ? w->lng[i] : e->min_lng;
+		e->max_lng = w->lng[i] > e->max_lng ? w->lng[i] : e->max_lng;
+	}
+	return 0;
+}
+
+int
+polyline_pack_writer_add(struct polyline_pack_writer *w, const char *polyline)
+{
+	struct polyline_pack_entry e;
+	size_t length;
+	int r;
+
+	if (!w || !polyline)
+		return POLYLINE_EINVAL;
+	if (w->error)
+		return w->error;
+	length = strlen(polyline);
+	if (length > UINT32_MAX || w->count >= INT32_MAX)
+		return POLYLINE_ERANGE;
+	if ((r = _pack_entry(w, &e, polyline)))
+		return r;
+
+	if (w->count >= w->size) {
+		size_t new_size = w->size ? w->size * 2 : 64;
+		struct polyline_pack_entry *entries = realloc(w->entries,
+							      new_size * sizeof(*entries));
+		if (!entries)
+			return POLYLINE_ENOMEM;
+		w->entries = entries;
+		w->size = new_size;
+	}
+
+	e.offset = w->offset;
+	e.length = length;
+	if (fwrite(polyline, 1, length + 1, w->f) != length + 1) {
+		/* The file is unusable from here on. */
+		w->error = POLYLINE_EIO;
+		return w->error;
+	}
+	w->offset += length + 1;
+	w->entries[w->count] = e;
+	return w->count++;
+}
+
+int
+polyline_pack_writer_close(struct polyline_pack_writer *w)
+{
+	static const char padding[8];
+	struct polyline_pack_header header = {
+		.magic = POLYLINE_PACK_MAGIC,
+		.version = POLYLINE_PACK_VERSION,
+		.byte_order = POLYLINE_PACK_BYTE_ORDER,
+	};
+	size_t pad;
+	int r = 0;
+
+	if (!w)
+		return POLYLINE_EINVAL;
+
+	pad = (8 - w->offset % 8) % 8;
+	header.count = w->count;
+	header.index_offset = w->offset + pad;
+	if (w->error ||
+	    fwrite(padding, 1, pad, w->f) != pad ||
+	    fwrite(w->entries, sizeof(*w->entries), w->count, w->f) != w->count ||
+	    fseek(w->f, 0, SEEK_SET) ||
+	    fwrite(&header, sizeof(header), 1, w->f) != 1)
+		r = POLYLINE_EIO;
+	if (fclose(w->f))
+		r = POLYLINE_EIO;
+
+	free(w->entries);
+	free(w->lat);
+	free(w->lng);
+	free(w);
+	return r;
+}
+
+int
+polyline_pack_open(struct polyline_pack **rpack, const char *path)
+{
+	const struct polyline_pack_header *header;
+	struct polyline_pack *pack;
+	struct stat st;
+	void *data;
+	int fd;
+
+	if (!rpack || !path)
+		return POLYLINE_EINVAL;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return POLYLINE_EIO;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return POLYLINE_EIO;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		close(fd);
+		return POLYLINE_EPARSE;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return POLYLINE_EIO;
+
+	header = data;
+	if (memcmp(header->magic, POLYLINE_PACK_MAGIC, sizeof(header->magic)) ||
+	    header->version != POLYLINE_PACK_VERSION ||
+	    header->byte_order != POLYLINE_PACK_BYTE_ORDER ||
+	    header->index_offset % 8 ||
+	    header->index_offset > (uint64_t)st.st_size ||
+	    header->count > ((uint64_t)st.st_size - header->index_offset) /
+			    sizeof(struct polyline_pack_entry)) {
+		munmap(data, st.st_size);
+		return POLYLINE_EPARSE;
+	}
+
+	if (!(pack = malloc(sizeof(*pack)))) {
+		munmap(data, st.st_size);
+		return POLYLINE_ENOMEM;
+	}
+	pack->data = data;
+	pack->length = st.st_size;
+	pack->index = (const struct polyline_pack_entry *)(pack->data + header->index_offset);
+	pack->count = header->count;
+	*rpack = pack;
+	return 0;
+}
+
+void
+polyline_pack_close(struct polyline_pack *pack)
+{
+	if (!pack)
+		return;
+	munmap((void *)pack->data, pack->length);
+	free(pack);
+}
+
+size_t
+polyline_pack_count(const struct polyline_pack *pack)
+{
+	return pack->count;
+}
+
+const struct polyline_pack_entry *
+polyline_pack_entry(const struct polyline_pack *pack, size_t id)
+{
+	if (id >= pack->count)
+		return NULL;
+	return &pack->index[id];
+}
+
+const char *
+polyline_pack_get(const struct polyline_pack *pack, size_t id)
+{
+	const struct polyline_pack_entry *e = polyline_pack_entry(pack, id);
+	if (!e || e->offset < sizeof(struct polyline_pack_header) ||
+	    e->offset >= pack->length || e->length >= pack->length - e->offset ||
+	    pack->data[e->offset + e->length])
+		return NULL;
+	return pack->data + e->offset;
+}
+
+int
+polyline_pack_decode(const struct polyline_pack *pack, size_t id,
+		     float **rptr, size_t *rsize)
+{
+	const char *polyline = polyline_pack_get(pack, id);
+	if (!polyline)
+		return POLYLINE_EINVAL;
+	return polyline_decode(rptr, rsize, polyline);
+}
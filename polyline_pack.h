@@ -0,0 +1,137 @@
+/**
+ * @file
+ * Polyline pack files: many encoded polylines in one file, with an index
+ * for O(1) access by id through a read-only memory mapping.
+ *
+ * Layout, in host byte order:
+ *
+ *     header   struct polyline_pack_header
+ *     data     polylines back to back, each null byte terminated
+ *     padding  to 8 bytes
+ *     index    struct polyline_pack_entry for every polyline
+ *
+ * Polylines are stored null byte terminated, so the decoders work
+ * directly on the mapped bytes.
+ */
+#ifndef __POLYLINE_PACK_H__
+#define __POLYLINE_PACK_H__
+#include <stdint.h>
+
+#include "polyline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLYLINE_PACK_MAGIC "PLYPACK" /**< First 8 bytes of a pack, including the null byte. */
+#define POLYLINE_PACK_VERSION 1 /**< Current pack format version. */
+#define POLYLINE_PACK_BYTE_ORDER 0x01020304 /**< Detects packs from hosts of different endianness. */
+
+/**
+ * File header of a pack.
+ */
+struct polyline_pack_header {
+	char magic[8];          /**< @ref POLYLINE_PACK_MAGIC */
+	uint32_t version;       /**< @ref POLYLINE_PACK_VERSION */
+	uint32_t byte_order;    /**< @ref POLYLINE_PACK_BYTE_ORDER */
+	uint64_t count;         /**< Number of polylines. */
+	uint64_t index_offset;  /**< File offset of the index. */
+};
+
+/**
+ * Index entry of a single polyline. The bounding box is given in
+ * degrees multiplied by 1e5, as for @ref POLYLINE_INT32.
+ */
+struct polyline_pack_entry {
+	uint64_t offset;        /**< File offset of the polyline. */
+	uint32_t length;        /**< Length of the polyline (`strlen()`). */
+	uint32_t coords;        /**< Number of coordinates. */
+	int32_t min_lat;
+	int32_t min_lng;
+	int32_t max_lat;
+	int32_t max_lng;
+};
+
+struct polyline_pack_writer;
+struct polyline_pack;
+
+/**
+ * Create a new pack file at `path` for writing, truncating an existing
+ * one.
+ *
+ * @param rwriter Set to the new writer on success.
+ * @param path Path of the file.
+ *
+ * @return 0 on success. `POLYLINE_EIO` if the file could not be
+ * 	created, `errno` has details. On error, a value < 0 is returned.
+ */
+int polyline_pack_writer_open(struct polyline_pack_writer **rwriter, const char *path);
+
+/**
+ * Append a polyline to the pack. The polyline is decoded once to
+ * validate it and to compute its index entry.
+ *
+ * @return On success, returns the id of the polyline, ids are assigned
+ * 	consecutively starting with 0. On error, a value < 0 is returned.
+ */
+int polyline_pack_writer_add(struct polyline_pack_writer *writer, const char *polyline);
+
+/**
+ * Write the index and header, close the file and free the writer.
+ *
+ * @return 0 on success. On error, a value < 0 is returned and the pack
+ * 	is incomplete. The writer is freed in any case.
+ */
+int polyline_pack_writer_close(struct polyline_pack_writer *writer);
+
+/**
+ * Map a pack file read-only. Only the header is checked, individual
+ * entries are bounds checked on access.
+ *
+ * @param rpack Set to the opened pack on success.
+ * @param path Path of the file.
+ *
+ * @return 0 on success. `POLYLINE_EIO` on I/O errors, `POLYLINE_EPARSE`
+ * 	if the file is not a valid pack.
+ */
+int polyline_pack_open(struct polyline_pack **rpack, const char *path);
+
+/**
+ * Unmap the pack and release it. Pointers returned by
+ * @ref polyline_pack_get() become invalid.
+ */
+void polyline_pack_close(struct polyline_pack *pack);
+
+/**
+ * Number of polylines in the pack.
+ */
+size_t polyline_pack_count(const struct polyline_pack *pack);
+
+/**
+ * Index entry of polyline `id`, or NULL if `id` is out of range.
+ */
+const struct polyline_pack_entry *polyline_pack_entry(const struct polyline_pack *pack,
+						      size_t id);
+
+/**
+ * Zero-copy access to polyline `id`.
+ *
+ * @return Pointer to the null byte terminated polyline within the
+ * 	mapping, or NULL if `id` is out of range or the entry is corrupt.
+ */
+const char *polyline_pack_get(const struct polyline_pack *pack, size_t id);
+
+/**
+ * Decode polyline `id` straight from the mapping. Buffer handling is the
+ * same as for @ref polyline_decode().
+ *
+ * @return On success, returns the number of *coordinates*. On error, a
+ * 	value < 0 is returned.
+ */
+int polyline_pack_decode(const struct polyline_pack *pack, size_t id,
+			 float **rptr, size_t *rsize);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Nearest point queries on a route.
+ *
+ * Points and segments are kept as structure of arrays in projected
+ * meters. Leaves hold `leaf_segments` consecutive segments, which are
+ * spatially close on any real route, so no sorting is needed to build a
+ * good hierarchy. The tree is complete and implicit: node k has children
+ * 2k + 1 and 2k + 2, leaves are padded to a power of two with empty
+ * boxes which are never visited.
+ */
+#include <math.h>
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "polyline_route.h"
+
+static const size_t leaf_segments = 8;
+/* Mean earth radius in meters. */
+static const double earth_radius = 6371008.8;
+
+struct polyline_route {
+	size_t points;
+	size_t segments;        /* at least one, a single point is repeated */
+	size_t leaves;          /* power of two */
+	double kx, ky;          /* degrees to meters */
+	double *x;              /* segments + 1 points, from longitude */
+	double *y;              /* segments + 1 points, from latitude */
+	double *dx;             /* segment vectors */
+	double *dy;
+	double *inv_len2;       /* 1 / squared length, 0 for empty segments */
+	double *along;          /* route length up to every point */
+	double *box;            /* min x, min y, max x, max y for every node */
+	double mem[];
+};
+
+static void
+_build_tree(struct polyline_route *r)
+{
+	size_t inner = r->leaves - 1;
+
+	for (size_t leaf = 0; leaf < r->leaves; leaf++) {
+		double *b = &r->box[(inner + leaf) * 4];
+		size_t first = leaf * leaf_segments;
+		b[0] = b[1] = INFINITY;
+		b[2] = b[3] = -INFINITY;
+		if (first >= r->segments)
+			continue;
+		size_t last = first + leaf_segments < r->segments ?
+			first + leaf_segments : r->segments;
+		for (size_t i = first; i <= last; i++) {
+			b[0] = fmin(b[0], r->x[i]);
+			b[1] = fmin(b[1], r->y[i]);
+			b[2] = fmax(b[2], r->x[i]);
+			b[3] = fmax(b[3], r->y[i]);
+		}
+	}
+	for (size_t k = inner; k-- > 0; ) {
+		const double *l = &r->box[(2 * k + 1) * 4], *h = &r->box[(2 * k + 2) * 4];
+		double *b = &r->box[k * 4];
+		b[0] = fmin(l[0], h[0]);
+		b[1] = fmin(l[1], h[1]);
+		b[2] = fmax(l[2], h[2]);
+		b[3] = fmax(l[3], h[3]);
+	}
+}
+
+int
+polyline_route_create(struct polyline_route **rroute, const char *polyline)
+{
+	struct polyline_route *r;
+	size_t points, segments, leaves = 1;
+	double min_lat = INFINITY, max_lat = -INFINITY;
+	int count;
+
+	if (!rroute || !polyline)
+		return POLYLINE_EINVAL;
+	if ((count = polyline_count(polyline)) <= 0)
+		return count ? count : POLYLINE_EINVAL;
+	points = count;
+	segments = points > 1 ? points - 1 : 1;
+	while (leaves * leaf_segments < segments)
+		leaves <<= 1;
+
+	size_t doubles = 3 * (segments + 1) + 3 * segments + 4 * (2 * leaves - 1);
+	if (!(r = malloc(sizeof(*r) + doubles * sizeof(double))))
+		return POLYLINE_ENOMEM;
+	r->points = points;
+	r->segments = segments;
+	r->leaves = leaves;
+	r->x = r->mem;
+	r->y = r->x + segments + 1;
+	r->along = r->y + segments + 1;
+	r->dx = r->along + segments + 1;
+	r->dy = r->dx + segments;
+	r->inv_len2 = r->dy + segments;
+	r->box = r->inv_len2 + segments;
+
+	if ((count = polyline_decode_soa(r->y, r->x, points, POLYLINE_DOUBLE, polyline)) < 0) {
+		free(r);
+		return count;
+	}
+	if (points == 1) {
+		r->x[1] = r->x[0];
+		r->y[1] = r->y[0];
+	}
+
+	for (size_t i = 0; i < points; i++) {
+		min_lat = fmin(min_lat, r->y[i]);
+		max_lat = fmax(max_lat, r->y[i]);
+	}
+	r->ky = earth_radius * M_PI / 180.0;
+	r->kx = r->ky * cos((min_lat + max_lat) / 2 * M_PI / 180.0);
+	for (size_t i = 0; i <= segments; i++) {
+		r->x[i] *= r->kx;
+		r->y[i] *= r->ky;
+	}
+
+	r->along[0] = 0;
+	for (size_t i = 0; i < segments; i++) {
+		double len2;
+		r->dx[i] = r->x[i + 1] - r->x[i];
+		r->dy[i] = r->y[i + 1] - r->y[i];
+		len2 = r->dx[i] * r->dx[i] + r->dy[i] * r->dy[i];
+		r->inv_len2[i] = len2 > 0 ? 1 / len2 : 0;
+		r->along[i + 1] = r->along[i] + sqrt(len2);
+	}
+	_build_tree(r);
+
+	*rroute = r;
+	return 0;
+}
+
+void
+polyline_route_destroy(struct polyline_route *route)
+{
+	free(route);
+}
+
+size_t
+polyline_route_points(const struct polyline_route *route)
+{
+	return route->points;
+}
+
+double
+polyline_route_length(const struct polyline_route *route)
+{
+	return route->along[route->segments];
+}
+
+/*
+ * Squared distances from (px, py) to the segments `first` to `end`
+ * exclusive and the positions of the closest points on them.
+ */
+static void
+_segment_dist2(const struct polyline_route *r, size_t first, size_t end,
+	       double px, double py, double *d2, double *t)
+{
+	size_t i = 0, n = end - first;
+#ifdef __SSE2__
+	const __m128d vx = _mm_set1_pd(px), vy = _mm_set1_pd(py);
+	const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+	for (; i + 2 <= n; i += 2) {
+		size_t j = first + i;
+		__m128d dx = _mm_loadu_pd(&r->dx[j]), dy = _mm_loadu_pd(&r->dy[j]);
+		__m128d wx = _mm_sub_pd(vx, _mm_loadu_pd(&r->x[j]));
+		__m128d wy = _mm_sub_pd(vy, _mm_loadu_pd(&r->y[j]));
+		__m128d tt = _mm_add_pd(_mm_mul_pd(wx, dx), _mm_mul_pd(wy, dy));
+		tt = _mm_mul_pd(tt, _mm_loadu_pd(&r->inv_len2[j]));
+		tt = _mm_min_pd(_mm_max_pd(tt, zero), one);
+		__m128d ex = _mm_sub_pd(wx, _mm_mul_pd(tt, dx));
+		__m128d ey = _mm_sub_pd(wy, _mm_mul_pd(tt, dy));
+		_mm_storeu_pd(&d2[i], _mm_add_pd(_mm_mul_pd(ex, ex), _mm_mul_pd(ey, ey)));
+		_mm_storeu_pd(&t[i], tt);
+	}
+#endif
+	for (; i < n; i++) {
+		size_t j = first + i;
+		double wx = px - r->x[j], wy = py - r->y[j];
+		double tt = (wx * r->dx[j] + wy * r->dy[j]) * r->inv_len2[j];
+		tt = tt < 0 ? 0 : tt > 1 ? 1 : tt;
+		double ex = wx - tt * r->dx[j], ey = wy - tt * r->dy[j];
+		d2[i] = ex * ex + ey * ey;
+		t[i] = tt;
+	}
+}
+
+static inline double
+_box_dist2(const double *b, double px, double py)
+{
+	double dx = fmax(fmax(b[0] - px, px - b[2]), 0);
+	double dy = fmax(fmax(b[1] - py, py - b[3]), 0);
+	return dx * dx + dy * dy;
+}
+
+int
+polyline_route_nearest(const struct polyline_route *route, double lat,
+		       double lng, struct polyline_route_match *match)
+{
+	struct {
+		size_t node;
+		double dist2;
+	} stack[2 * 64];
+	double d2[leaf_segments], t[leaf_segments];
+	double px, py, best = INFINITY, best_t = 0;
+	size_t best_seg = 0, inner;
+	int top = 0;
+
+	if (!route || !match || !isfinite(lat) || !isfinite(lng))
+		return POLYLINE_EINVAL;
+	px = lng * route->kx;
+	py = lat * route->ky;
+	inner = route->leaves - 1;
+
+	stack[top].node = 0;
+	stack[top++].dist2 = _box_dist2(route->box, px, py);
+	while (top) {
+		size_t k = stack[--top].node;
+		/* Equal distances are kept for ties on earlier segments. */
+		if (stack[top].dist2 > best)
+			continue;
+
+		if (k >= inner) {
+			size_t first = (k - inner) * leaf_segments;
+			if (first >= route->segments)
+				continue;
+			size_t end = first + leaf_segments < route->segments ?
+				first + leaf_segments : route->segments;
+			_segment_dist2(route, first, end, px, py, d2, t);
+			for (size_t i = 0; i < end - first; i++) {
+				if (d2[i] < best || (d2[i] == best && first + i < best_seg)) {
+					best = d2[i];
+					best_t = t[i];
+					best_seg = first + i;
+				}
+			}
+			continue;
+		}
+
+		/* Push the farther child first, so the nearer one is visited first. */
+		size_t l = 2 * k + 1, h = 2 * k + 2;
+		double dl = _box_dist2(&route->box[l * 4], px, py);
+		double dh = _box_dist2(&route->box[h * 4], px, py);
+		if (dl <= dh) {
+			stack[top].node = h;
+			stack[top++].dist2 = dh;
+			stack[top].node = l;
+			stack[top++].dist2 = dl;
+		} else {
+			stack[top].node = l;
+			stack[top++].dist2 = dl;
+			stack[top].node = h;
+			stack[top++].dist2 = dh;
+		}
+	}
+
+	match->segment = best_seg;
+	match->fraction = best_t;
+	match->lat = (route->y[best_seg] + best_t * route->dy[best_seg]) / route->ky;
+	match->lng = (route->x[best_seg] + best_t * route->dx[best_seg]) / route->kx;
+	match->distance = sqrt(best);
+	match->along = route->along[best_seg] +
+		       best_t * (route->along[best_seg + 1] - route->along[best_seg]);
+	return 0;
+}
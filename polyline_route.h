@@ -0,0 +1,73 @@
+/**
+ * @file
+ * Routes built once from a polyline for repeated nearest point queries,
+ * e.g. snapping GPS positions to the route a vehicle is following.
+ *
+ * Coordinates are projected to meters with an equirectangular projection
+ * around the middle latitude of the route. This is accurate to a fraction
+ * of a percent for routes spanning a few hundred kilometers.
+ *
+ * Segments are grouped into leaves of consecutive segments. A bounding
+ * volume hierarchy over the leaves prunes most of them, so a query costs
+ * about O(log n) instead of O(n).
+ */
+#ifndef __POLYLINE_ROUTE_H__
+#define __POLYLINE_ROUTE_H__
+#include <stddef.h>
+
+#include "polyline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Result of @ref polyline_route_nearest().
+ */
+struct polyline_route_match {
+	size_t segment;         /**< Segment from point `segment` to `segment + 1`. */
+	double fraction;        /**< Position on the segment, 0.0 to 1.0. */
+	double lat;             /**< Latitude of the closest point on the route. */
+	double lng;             /**< Longitude of the closest point on the route. */
+	double distance;        /**< Meters from the query to the closest point. */
+	double along;           /**< Meters along the route to the closest point. */
+};
+
+struct polyline_route;
+
+/**
+ * Decode `polyline` and build a route for queries.
+ *
+ * @return 0 on success. On error, including an empty polyline, a value
+ * 	< 0 is returned.
+ */
+int polyline_route_create(struct polyline_route **rroute, const char *polyline);
+
+/**
+ * Free the route.
+ */
+void polyline_route_destroy(struct polyline_route *route);
+
+/**
+ * Number of points of the route.
+ */
+size_t polyline_route_points(const struct polyline_route *route);
+
+/**
+ * Length of the route in meters.
+ */
+double polyline_route_length(const struct polyline_route *route);
+
+/**
+ * Find the point on the route closest to (`lat`, `lng`). Of equally
+ * close points, the one on the earliest segment is preferred.
+ *
+ * @return 0 on success. On error, a value < 0 is returned.
+ */
+int polyline_route_nearest(const struct polyline_route *route, double lat,
+			   double lng, struct polyline_route_match *match);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
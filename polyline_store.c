@@ -0,0 +1,335 @@
+/*
+ * Deduplicating polyline store.
+ *
+ * Runs are found through a chained hash table over their key, the start
+ * point and the delta bytes. Members are slices of one array of run ids.
+ * A point ends a run if its position hashes to zero in the lowest
+ * `cut_bits` bits, bounded by `min_run` and `max_run` points.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "polyline_internal.h"
+#include "polyline_store.h"
+
+static const int cut_bits = 5; /* runs of about 32 points */
+static const size_t min_run = 8;
+static const size_t max_run = 256;
+static const uint32_t no_run = UINT32_MAX;
+
+struct run {
+	int32_t start[2];
+	int32_t end[2];
+	uint32_t next;          /* bucket chain */
+	uint32_t refs;
+	uint32_t len;
+	char bytes[];           /* deltas of all points but the first */
+};
+
+struct member {
+	size_t first;           /* into run_ids */
+	size_t count;
+};
+
+struct polyline_store {
+	struct run **runs;
+	size_t runs_size;
+	uint32_t *buckets;
+	size_t mask;
+	struct member *members;
+	size_t members_size;
+	uint32_t *run_ids;
+	size_t run_ids_size;
+	char *scratch;          /* bytes of the run being cut */
+	size_t scratch_size;
+	struct polyline_store_stats stats;
+};
+
+static int
+_grow(void *rptr, size_t *rsize, size_t need, size_t elem)
+{
+	void **ptr = rptr;
+	if (need <= *rsize)
+		return 0;
+	size_t new_size = *rsize ? *rsize : 64;
+	while (new_size < need)
+		new_size *= 2;
+	void *p = realloc(*ptr, new_size * elem);
+	if (!p)
+		return POLYLINE_ENOMEM;
+	*ptr = p;
+	*rsize = new_size;
+	return 0;
+}
+
+/*
+ * Hash the start point and the delta bytes of a run.
+ */
+static uint64_t
+_hash(const int32_t *start, const char *bytes, size_t len)
+{
+	return _hash_bytes((uint64_t)(uint32_t)start[0] << 32 | (uint32_t)start[1], bytes, len);
+}
+
+static inline int
+_is_cut(const int32_t *pos)
+{
+	uint64_t h = ((uint64_t)(uint32_t)pos[0] << 32 | (uint32_t)pos[1]) * 0x9e3779b97f4a7c15ULL;
+	return !(h >> (64 - cut_bits));
+}
+
+int
+polyline_store_create(struct polyline_store **rstore)
+{
+	struct polyline_store *store;
+	size_t buckets = 1024;
+
+	if (!rstore)
+		return POLYLINE_EINVAL;
+	if (!(store = calloc(1, sizeof(*store))))
+		return POLYLINE_ENOMEM;
+	if (!(store->buckets = malloc(buckets * sizeof(*store->buckets)))) {
+		free(store);
+		return POLYLINE_ENOMEM;
+	}
+	memset(store->buckets, 0xff, buckets * sizeof(*store->buckets));
+	store->mask = buckets - 1;
+	*rstore = store;
+	return 0;
+}
+
+void
+polyline_store_destroy(struct polyline_store *store)
+{
+	if (!store)
+		return;
+	for (size_t i = 0; i < store->stats.runs; i++)
+		free(store->runs[i]);
+	free(store->runs);
+	free(store->buckets);
+	free(store->members);
+	free(store->run_ids);
+	free(store->scratch);
+	free(store);
+}
+
+/*
+ * Double the buckets once there are more runs than buckets.
+ */
+static int
+_rehash(struct polyline_store *store)
+{
+	size_t buckets = (store->mask + 1) * 2;
+	uint32_t *b = malloc(buckets * sizeof(*b));
+
+	if (!b)
+		return POLYLINE_ENOMEM;
+	memset(b, 0xff, buckets * sizeof(*b));
+	for (uint32_t i = 0; i < store->stats.runs; i++) {
+		struct run *r = store->runs[i];
+		size_t k = _hash(r->start, r->bytes, r->len) & (buckets - 1);
+		r->next = b[k];
+		b[k] = i;
+	}
+	free(store->buckets);
+	store->buckets = b;
+	store->mask = buckets - 1;
+	return 0;
+}
+
+/*
+ * Find or add the run starting at `start` with the scratch bytes, and
+ * append it to the run ids of the member being added.
+ */
+static int
+_intern(struct polyline_store *store, const int32_t *start, const int32_t *end,
+	size_t len)
+{
+	uint64_t hash = _hash(start, store->scratch, len);
+	uint32_t id;
+	struct run *r;
+
+	for (id = store->buckets[hash & store->mask]; id != no_run; id = r->next) {
+		r = store->runs[id];
+		if (r->len == len && r->start[0] == start[0] && r->start[1] == start[1] &&
+		    !memcmp(r->bytes, store->scratch, len))
+			break;
+	}
+	if (id == no_run) {
+		if (store->stats.runs >= no_run ||
+		    _grow(&store->runs, &store->runs_size, store->stats.runs + 1, sizeof(*store->runs)))
+			return POLYLINE_ENOMEM;
+		if (!(r = malloc(sizeof(*r) + len)))
+			return POLYLINE_ENOMEM;
+		memcpy(r->start, start, sizeof(r->start));
+		memcpy(r->end, end, sizeof(r->end));
+		memcpy(r->bytes, store->scratch, len);
+		r->len = len;
+		r->refs = 0;
+		id = store->stats.runs++;
+		store->runs[id] = r;
+		r->next = store->buckets[hash & store->mask];
+		store->buckets[hash & store->mask] = id;
+		store->stats.stored_bytes += sizeof(*r) + len + sizeof(*store->runs);
+		if (store->stats.runs > store->mask + 1 && _rehash(store))
+			return POLYLINE_ENOMEM;
+	}
+
+	struct member *m = &store->members[store->stats.polylines];
+	if (_grow(&store->run_ids, &store->run_ids_size, m->first + m->count + 1,
+		  sizeof(*store->run_ids)))
+		return POLYLINE_ENOMEM;
+	store->run_ids[m->first + m->count++] = id;
+	store->runs[id]->refs++;
+	return 0;
+}
+
+/*
+ * Remove the runs from `first` on, added for a polyline that failed.
+ */
+static void
+_drop_runs(struct polyline_store *store, size_t first)
+{
+	while (store->stats.runs > first) {
+		uint32_t id = --store->stats.runs;
+		struct run *r = store->runs[id];
+		uint32_t *link = &store->buckets[_hash(r->start, r->bytes, r->len) & store->mask];
+
+		while (*link != id)
+			link = &store->runs[*link]->next;
+		*link = r->next;
+		store->stats.stored_bytes -= sizeof(*r) + r->len + sizeof(*store->runs);
+		free(r);
+	}
+}
+
+int
+polyline_store_add(struct polyline_store *store, const char *polyline)
+{
+	int32_t pos[2] = {0, 0}, start[2];
+	uint32_t val = 0;
+	size_t k = 0, points = 0, len = 0, runs = store ? store->stats.runs : 0;
+	const char *p, *point_start;
+	int chunk_idx = 0, r = 0;
+
+	if (!store || !polyline)
+		return POLYLINE_EINVAL;
+	if (store->stats.polylines >= INT32_MAX ||
+	    _grow(&store->members, &store->members_size, store->stats.polylines + 1,
+		  sizeof(*store->members)))
+		return POLYLINE_ENOMEM;
+	struct member *m = &store->members[store->stats.polylines];
+	m->first = store->stats.polylines ? m[-1].first + m[-1].count : 0;
+	m->count = 0;
+
+	for (p = point_start = polyline; *p && !r; p++) {
+		uint32_t chunk = (uint8_t)*p;
+		if (chunk < 0x3f || chunk > 0x7e || chunk_idx >= max_5bit_chunks_decode) {
+			r = POLYLINE_EPARSE;
+			break;
+		}
+		chunk -= 0x3f;
+		val |= (chunk & 0x1f) << (chunk_idx++ * 5);
+		if (chunk & 0x20)
+			continue;
+
+		pos[k & 1] += (val >> 1) ^ -(val & 1);
+		val = 0;
+		chunk_idx = 0;
+		if (!(k++ & 1))
+			continue;
+
+		/* A point is complete, its bytes are point_start to p. */
+		if (!points) {
+			memcpy(start, pos, sizeof(start));
+		} else {
+			size_t n = p + 1 - point_start;
+			if ((r = _grow(&store->scratch, &store->scratch_size, len + n, 1)))
+				break;
+			memcpy(store->scratch + len, point_start, n);
+			len += n;
+		}
+		points++;
+		point_start = p + 1;
+		if (points >= max_run || (points >= min_run && _is_cut(pos))) {
+			r = _intern(store, start, pos, len);
+			points = len = 0;
+		}
+	}
+	if (!r && (chunk_idx || (k & 1)))
+		r = POLYLINE_ETRUNC;
+	if (!r && points)
+		r = _intern(store, start, pos, len);
+	if (r) {
+		/* Drop the references and the runs only this polyline added. */
+		for (size_t i = 0; i < m->count; i++)
+			store->runs[store->run_ids[m->first + i]]->refs--;
+		_drop_runs(store, runs);
+		return r;
+	}
+
+	store->stats.run_refs += m->count;
+	store->stats.input_bytes += p - polyline + 1;
+	store->stats.stored_bytes += sizeof(*m) + m->count * sizeof(*store->run_ids);
+	return store->stats.polylines++;
+}
+
+size_t
+polyline_store_count(const struct polyline_store *store)
+{
+	return store->stats.polylines;
+}
+
+static inline uint32_t
+_zigzag(int32_t delta)
+{
+	return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+int
+polyline_store_get(const struct polyline_store *store, size_t id,
+		   char **rptr, size_t *rsize)
+{
+	const struct member *m;
+	int32_t prev[2] = {0, 0};
+	size_t need = 1, idx = 0;
+
+	if (!store || !rptr || !rsize || (*rptr && !*rsize) || (!*rptr && *rsize))
+		return POLYLINE_EINVAL;
+	if (id >= store->stats.polylines)
+		return POLYLINE_EINVAL;
+
+	m = &store->members[id];
+	for (size_t i = 0; i < m->count; i++)
+		need += 2 * max_5bit_chunks_decode + store->runs[store->run_ids[m->first + i]]->len;
+	if (need > INT32_MAX)
+		return POLYLINE_ERANGE;
+	if (need > *rsize) {
+		char *p = realloc(*rptr, need);
+		if (!p)
+			return POLYLINE_ENOMEM;
+		*rptr = p;
+		*rsize = need;
+	}
+
+	for (size_t i = 0; i < m->count; i++) {
+		const struct run *r = store->runs[store->run_ids[m->first + i]];
+		/* Wrapping differences, as the decoder accumulates them. */
+		idx += _encode_value(*rptr + idx, _zigzag((int32_t)((uint32_t)r->start[0] - (uint32_t)prev[0])));
+		idx += _encode_value(*rptr + idx, _zigzag((int32_t)((uint32_t)r->start[1] - (uint32_t)prev[1])));
+		memcpy(*rptr + idx, r->bytes, r->len);
+		idx += r->len;
+		memcpy(prev, r->end, sizeof(prev));
+	}
+	(*rptr)[idx] = '\0';
+	return idx;
+}
+
+void
+polyline_store_stats(const struct polyline_store *store,
+		     struct polyline_store_stats *stats)
+{
+	*stats = store->stats;
+	stats->stored_bytes += (store->mask + 1) * sizeof(*store->buckets);
+}
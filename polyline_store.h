@@ -0,0 +1,88 @@
+/**
+ * @file
+ * Deduplicating in-memory store for many polylines sharing stretches,
+ * such as routes leaving the same depot or taking the same highway.
+ *
+ * Polylines are cut into runs of points where the absolute position of a
+ * point hashes to a marker value, so equal stretches are cut the same
+ * way in every polyline. A run is keyed by its absolute start point and
+ * keeps the encoded deltas of its other points, and is stored only once.
+ * A member polyline is a list of runs. It is rebuilt by re-encoding the
+ * delta from the end of one run to the start of the next and copying the
+ * run bytes in between.
+ */
+#ifndef __POLYLINE_STORE_H__
+#define __POLYLINE_STORE_H__
+#include <stddef.h>
+
+#include "polyline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Store statistics, see @ref polyline_store_stats().
+ */
+struct polyline_store_stats {
+	size_t polylines;       /**< Polylines added. */
+	size_t runs;            /**< Distinct runs stored. */
+	size_t run_refs;        /**< Runs referenced by all polylines. */
+	size_t input_bytes;     /**< Bytes of all polylines added, with null bytes. */
+	size_t stored_bytes;    /**< Bytes used by the store. */
+};
+
+struct polyline_store;
+
+/**
+ * Create an empty store.
+ *
+ * @return 0 on success. On error, a value < 0 is returned.
+ */
+int polyline_store_create(struct polyline_store **rstore);
+
+/**
+ * Free the store.
+ */
+void polyline_store_destroy(struct polyline_store *store);
+
+/**
+ * Add a polyline. Works in a single pass over `polyline` without
+ * decoding it into coordinates, so polylines can be streamed in one by
+ * one.
+ *
+ * @return On success, returns the id of the polyline, ids are assigned
+ * 	consecutively starting with 0. On error, a value < 0 is returned.
+ */
+int polyline_store_add(struct polyline_store *store, const char *polyline);
+
+/**
+ * Number of polylines in the store.
+ */
+size_t polyline_store_count(const struct polyline_store *store);
+
+/**
+ * Rebuild polyline `id`. The result is the same as the polyline added,
+ * provided that was canonically encoded, e.g. by @ref polyline_encode().
+ *
+ * @param rptr Pointer to a `char*` which will be assigned an allocated
+ * 	C string. Same semantics as for @ref polyline_encode().
+ * @param rsize Size of array provided or allocated.
+ *
+ * @return On success, returns the length (`strlen()`) of the C string
+ * 	assigned to `*rptr`. On error, a value < 0 is returned.
+ */
+int polyline_store_get(const struct polyline_store *store, size_t id,
+		       char **rptr, size_t *rsize);
+
+/**
+ * Fill `stats` with the current statistics of `store`. The savings are
+ * `input_bytes - stored_bytes`.
+ */
+void polyline_store_stats(const struct polyline_store *store,
+			  struct polyline_store_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,370 @@
+/*
+ * Persistent polyline server on a Unix domain socket.
+ *
+ * One worker thread per CPU runs its own epoll loop. All workers wait
+ * on the listening socket with EPOLLEXCLUSIVE and accept connections
+ * themselves, so a connection stays with one worker. Each read drains
+ * the socket, up to the size of the largest frame. Every complete frame
+ * in the input is handled as a batch and all responses go out with as
+ * few writes as possible. Workers reuse their encode and decode buffers
+ * across requests through a polyline_ctx each.
+ */
+#define _GNU_SOURCE /* accept4() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "polyline.h"
+#include "serve.h"
+
+#define eprintf(...) fprintf(stderr, __VA_ARGS__)
+
+static const size_t read_size = 64 * 1024;
+/* Room for the largest frame, no reading beyond until frames are handled. */
+static const size_t max_input = SERVE_MAX_FRAME + sizeof(struct serve_frame);
+static const int max_events = 64;
+
+struct bytes {
+	char *data;
+	size_t off;
+	size_t len;
+	size_t size;
+};
+
+struct conn {
+	int fd;
+	int eof;
+	int pending;            /* waiting for EPOLLOUT instead of EPOLLIN */
+	struct bytes in;
+	struct bytes out;
+};
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int listen_fd;
+	struct polyline_ctx *ctx;
+	float *coords;          /* aligned copy of encode requests */
+	size_t coords_size;
+};
+
+static int
+_reserve(struct bytes *b, size_t n)
+{
+	if (b->len + n > b->size) {
+		size_t new_size = b->size ? b->size : read_size;
+		while (new_size < b->len + n)
+			new_size *= 2;
+		char *data = realloc(b->data, new_size);
+		if (!data)
+			return -1;
+		b->data = data;
+		b->size = new_size;
+	}
+	return 0;
+}
+
+static int
+_respond(struct conn *c, int32_t code, const void *payload, size_t length)
+{
+	struct serve_frame resp = {
+		.length = length,
+		.code = code,
+	};
+	if (_reserve(&c->out, sizeof(resp) + length))
+		return -1;
+	memcpy(c->out.data + c->out.len, &resp, sizeof(resp));
+	if (length)
+		memcpy(c->out.data + c->out.len + sizeof(resp), payload, length);
+	c->out.len += sizeof(resp) + length;
+	return 0;
+}
+
+static int
+_decode(struct worker *w, struct conn *c, char *payload, size_t length)
+{
+	/*
+	 * The library wants a C string. There is always at least one
+	 * byte of room behind the payload, see _read(). Borrow it.
+	 */
+	const float *coords;
+	char saved = payload[length];
+	payload[length] = '\0';
+	ssize_t r = polyline_ctx_decode(w->ctx, payload, &coords);
+	payload[length] = saved;
+	if (r < 0)
+		return _respond(c, r, NULL, 0);
+	return _respond(c, r, coords, r * 2 * sizeof(float));
+}
+
+static int
+_encode(struct worker *w, struct conn *c, const char *payload, size_t length)
+{
+	size_t floats = length / sizeof(float);
+	const char *polyline;
+	ssize_t r;
+
+	if (length % (2 * sizeof(float)))
+		return _respond(c, POLYLINE_EINVAL, NULL, 0);
+	if (floats > w->coords_size) {
+		float *coords = realloc(w->coords, length);
+		if (!coords)
+			return _respond(c, POLYLINE_ENOMEM, NULL, 0);
+		w->coords = coords;
+		w->coords_size = floats;
+	}
+	memcpy(w->coords, payload, length);
+	r = polyline_ctx_encode(w->ctx, w->coords, floats / 2, &polyline);
+	if (r < 0)
+		return _respond(c, r, NULL, 0);
+	return _respond(c, r, polyline, r);
+}
+
+/*
+ * Handle all complete frames in the input buffer.
+ */
+static int
+_handle_frames(struct worker *w, struct conn *c)
+{
+	struct serve_frame req;
+	int r = 0;
+
+	while (!r && c->in.len - c->in.off >= sizeof(req)) {
+		memcpy(&req, c->in.data + c->in.off, sizeof(req));
+		if (req.length > SERVE_MAX_FRAME)
+			return -1;
+		if (c->in.len - c->in.off - sizeof(req) < req.length)
+			break;
+
+		char *payload = c->in.data + c->in.off + sizeof(req);
+		switch (req.code) {
+		case SERVE_OP_DECODE:
+			r = _decode(w, c, payload, req.length);
+			break;
+		case SERVE_OP_ENCODE:
+			r = _encode(w, c, payload, req.length);
+			break;
+		default:
+			r = _respond(c, POLYLINE_EINVAL, NULL, 0);
+			break;
+		}
+		c->in.off += sizeof(req) + req.length;
+	}
+
+	/* Move a partial frame to the front. */
+	memmove(c->in.data, c->in.data + c->in.off, c->in.len - c->in.off);
+	c->in.len -= c->in.off;
+	c->in.off = 0;
+	return r;
+}
+
+/*
+ * Read until the socket is drained or `max_input` bytes are buffered.
+ * Anything left is read after the buffered frames have been handled, as
+ * EPOLLIN is level-triggered. Keeps one spare byte behind the data for
+ * _decode().
+ */
+static int
+_read(struct conn *c)
+{
+	while (c->in.len < max_input) {
+		if (_reserve(&c->in, read_size + 1))
+			return -1;
+		size_t n = c->in.size - c->in.len - 1;
+		if (n > max_input - c->in.len)
+			n = max_input - c->in.len;
+		ssize_t r = read(c->fd, c->in.data + c->in.len, n);
+		if (r > 0) {
+			c->in.len += r;
+			continue;
+		}
+		if (r == 0) {
+			c->eof = 1;
+			return 0;
+		}
+		if (errno == EINTR)
+			continue;
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if output is still pending, 0 if all was written.
+ */
+static int
+_flush(struct conn *c)
+{
+	while (c->out.off < c->out.len) {
+		ssize_t r = send(c->fd, c->out.data + c->out.off,
+				 c->out.len - c->out.off, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		}
+		c->out.off += r;
+	}
+	c->out.off = c->out.len = 0;
+	return 0;
+}
+
+static void
+_close(struct worker *w, struct conn *c)
+{
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+}
+
+static void
+_accept(struct worker *w)
+{
+	for (;;) {
+		int fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		struct conn *c = calloc(1, sizeof(*c));
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = c,
+		};
+		if (!c || epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+	}
+}
+
+static void *
+_worker_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[max_events];
+
+	for (;;) {
+		int n = epoll_wait(w->epfd, events, max_events, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			eprintf("epoll_wait: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+			if (!c) {
+				_accept(w);
+				continue;
+			}
+
+			int pending;
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			    (_read(c) || _handle_frames(w, c))) {
+				_close(w, c);
+				continue;
+			}
+			if ((pending = _flush(c)) < 0 || (c->eof && !pending)) {
+				_close(w, c);
+				continue;
+			}
+
+			struct epoll_event ev = {
+				.events = pending ? EPOLLOUT : EPOLLIN,
+				.data.ptr = c,
+			};
+			/* Stop reading while the client is not reading responses. */
+			if (pending != c->pending && !epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev))
+				c->pending = pending;
+		}
+	}
+}
+
+static int
+_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		eprintf("socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Replace a stale socket, but nothing else. */
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, SOMAXCONN)) {
+		eprintf("%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+serve(const char *path)
+{
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	int listen_fd;
+
+	if (nworkers < 1)
+		nworkers = 1;
+	if ((listen_fd = _listen(path)) < 0)
+		return 1;
+
+	struct worker *workers = calloc(nworkers, sizeof(*workers));
+	if (!workers) {
+		eprintf("out of memory!\n");
+		return 1;
+	}
+	for (long i = 0; i < nworkers; i++) {
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLEXCLUSIVE,
+			.data.ptr = NULL,
+		};
+		workers[i].listen_fd = listen_fd;
+		if (polyline_ctx_create(&workers[i].ctx)) {
+			eprintf("out of memory!\n");
+			return 1;
+		}
+		if ((workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		    epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+			eprintf("epoll: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	eprintf("serving on %s with %ld workers\n", path, nworkers);
+	for (long i = 1; i < nworkers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, _worker_loop, &workers[i])) {
+			eprintf("pthread_create failed\n");
+			return 1;
+		}
+	}
+	_worker_loop(&workers[0]);
+	return 1;
+}
@@ -0,0 +1,38 @@
+/*
+ * Wire format of the polyline server, shared by serve.c and client.c.
+ *
+ * Every request and response is a frame header in host byte order
+ * followed by `length` payload bytes. Requests on a connection may be
+ * pipelined, responses are sent in request order.
+ *
+ * SERVE_OP_DECODE: payload is the polyline, without a null byte. The
+ *                  response payload holds `code` coordinates as
+ *                  interleaved floats.
+ * SERVE_OP_ENCODE: payload holds interleaved lat/lng floats. The
+ *                  response payload is the polyline of `code` bytes,
+ *                  without a null byte.
+ *
+ * On errors, the response `code` is the error returned by the library
+ * and the payload is empty.
+ */
+#ifndef __SERVE_H__
+#define __SERVE_H__
+#include <stdint.h>
+
+#define SERVE_OP_DECODE 1
+#define SERVE_OP_ENCODE 2
+
+/* Connections sending larger frames are closed. */
+#define SERVE_MAX_FRAME (64 * 1024 * 1024)
+
+struct serve_frame {
+	uint32_t length;        /* payload bytes following the header */
+	int32_t code;           /* request: SERVE_OP_*, response: result */
+};
+
+/*
+ * Listen on the Unix domain socket `path` and serve requests until
+ * killed. Returns the process exit code on setup errors.
+ */
+int serve(const char *path);
+#endif
@@ -1,9 +1,22 @@
+#include <limits.h>
 #include <math.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "polyline.h"
+#include "polyline_cache.h"
+#include "polyline_pack.h"
+#include "polyline_route.h"
+#include "polyline_store.h"
+#include "serve.h"
 
 #ifdef DEBUG
 #define dprintf(...) fprintf(stdout, __VA_ARGS__)
@@ -298,6 +311,1030 @@ free:
 		free(rptr);
 }
 
+static void
+test_nd_roundtrip(void)
+{
+	/* lat, lng, elevation, timestamp in structure-of-arrays layout */
+	const double coords[] = {
+		38.5, 40.7, 43.252,
+		-120.2, -120.95, -126.453,
+		512.3, 498.1, -12.7,
+		1700000000.0, 1700000001.5, 1700000060.25,
+	};
+	const int precision[] = {5, 5, 1, 2};
+	size_t n = 3, size = 0, csize = 0;
+	double *result = NULL;
+	char *cptr = NULL;
+	int dims = 0, rprecision[POLYLINE_ND_MAX_DIMS];
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	r = polyline_encode_nd(&cptr, &csize, coords, n, 4, precision);
+	if (assert_int_gt("encode_nd error?", 0, r))
+		goto free;
+	r = polyline_decode_nd(&result, &size, &dims, rprecision, cptr);
+	if (assert_int_equal("decode_nd points", n, r))
+		goto free;
+	if (assert_int_equal("decode_nd dims", 4, dims))
+		goto free;
+	for (int d = 0; d < 4; d++) {
+		if (assert_int_equal("decode_nd precision", precision[d], rprecision[d]))
+			goto free;
+		for (size_t i = 0; i < n; i++) {
+			if (fabs(result[d * n + i] - coords[d * n + i]) > 1e-6) {
+				printf("ERROR: nd value %d/%lu %f != %f\n", d, i,
+				       result[d * n + i], coords[d * n + i]);
+				goto free;
+			}
+		}
+	}
+
+	/*
+	 * A 2D polyline with precision 5 carries the Google body. Integer
+	 * deltas give exactly Google's reference string, while the float
+	 * based polyline_encode() is off by one in the last value.
+	 */
+	r = polyline_encode_nd(&cptr, &csize, coords, n, 2, precision);
+	if (assert_str_equal("nd body", "@ADD" "_p~iF~ps|U_ulLnnqC_mqNvxq`@", cptr))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	free(result);
+	free(cptr);
+}
+
+static void
+test_nd_errors(void)
+{
+	double *result = NULL;
+	size_t size = 0;
+	int dims, r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	/* wrong version */
+	r = polyline_decode_nd(&result, &size, &dims, NULL, "AA_??");
+	if (assert_int_equal("bad version", POLYLINE_EPARSE, r))
+		return;
+	/* header only, zero points */
+	r = polyline_decode_nd(&result, &size, &dims, NULL, "@@D");
+	if (assert_int_equal("empty body", 0, r))
+		return;
+	/* truncated header */
+	r = polyline_decode_nd(&result, &size, &dims, NULL, "@A_");
+	if (assert_int_equal("truncated header", POLYLINE_ETRUNC, r))
+		return;
+	/* 2D header, three values */
+	r = polyline_decode_nd(&result, &size, &dims, NULL, "@ADD???");
+	if (assert_int_equal("odd values", POLYLINE_ETRUNC, r))
+		return;
+	/* continuation at the end */
+	r = polyline_decode_nd(&result, &size, &dims, NULL, "@ADD??_");
+	if (assert_int_equal("incomplete chunk", POLYLINE_ETRUNC, r))
+		return;
+	r = polyline_decode_nd(&result, &size, &dims, NULL, "@ADD?\x01");
+	if (assert_int_equal("bad chars", POLYLINE_EPARSE, r))
+		return;
+
+	free(result);
+	printf("GOOD\n");
+}
+
+static void
+test_decode_parallel(void)
+{
+	size_t n = 100000, csize = 0, size = 0, psize = 0;
+	float *coords = malloc(n * 2 * sizeof(float));
+	float *result = NULL, *presult = NULL;
+	char *cptr = NULL;
+	int r, pr;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	srand(42);
+	for (size_t i = 0; i < n * 2; i++)
+		coords[i] = (float)(rand() % 36000000 - 18000000) / 100000.0f;
+
+	r = polyline_encode(&cptr, &csize, coords, n);
+	if (assert_int_gt("encode error?", 0, r))
+		goto free;
+	/* Both accumulate integers, so results must match exactly. */
+	r = polyline_decode(&result, &size, cptr);
+	for (int nthreads = 1; nthreads <= 8; nthreads += 3) {
+		pr = polyline_decode_parallel(&presult, &psize, cptr, nthreads);
+		if (assert_int_equal("parallel coordinate count", r, pr))
+			goto free;
+		if (memcmp(result, presult, r * 2 * sizeof(float))) {
+			printf("ERROR: nthreads=%d differs\n", nthreads);
+			goto free;
+		}
+	}
+
+	/* More threads than the library starts. */
+	pr = polyline_decode_parallel(&presult, &psize, cptr, INT_MAX);
+	if (assert_int_equal("parallel nthreads INT_MAX", r, pr))
+		goto free;
+	/* Zero deltas, long enough for more chunks than the thread cap. */
+	size_t big_len = 80 * 64 * 1024;
+	char *big = malloc(big_len + 1);
+	memset(big, '?', big_len);
+	big[big_len] = '\0';
+	pr = polyline_decode_parallel(&presult, &psize, big, INT_MAX);
+	free(big);
+	if (assert_int_equal("parallel nthreads capped", (int)(big_len / 2), pr))
+		goto free;
+
+	/* Errors in chunks other than the first. */
+	cptr[strlen(cptr) - 1] = '_';
+	if (assert_int_equal("parallel truncated", POLYLINE_ETRUNC,
+			     polyline_decode_parallel(&presult, &psize, cptr, 4)))
+		goto free;
+	cptr[strlen(cptr) / 2] = '!';
+	if (assert_int_equal("parallel parse error", POLYLINE_EPARSE,
+			     polyline_decode_parallel(&presult, &psize, cptr, 4)))
+		goto free;
+	if (assert_int_equal("parallel nthreads 0", POLYLINE_EINVAL,
+			     polyline_decode_parallel(&presult, &psize, cptr, 0)))
+		goto free;
+	if (assert_int_equal("parallel empty", 0,
+			     polyline_decode_parallel(&presult, &psize, "", 4)))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	free(coords);
+	free(cptr);
+	free(result);
+	free(presult);
+}
+
+static void
+test_transcode(void)
+{
+	char *result = NULL, *back = NULL;
+	size_t size = 0, bsize = 0;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	r = polyline_transcode(&result, &size, "_p~iF~ps|U_ulLnnqC_mqNvxq`@", 5, 6);
+	if (assert_str_equal("5 -> 6", "_izlhA~rlgdF_{geC~ywl@_kwzCn`{nI", result))
+		goto free;
+	if (assert_int_equal("5 -> 6 length", strlen(result), r))
+		goto free;
+	r = polyline_transcode(&back, &bsize, result, 6, 5);
+	if (assert_str_equal("6 -> 5", "_p~iF~ps|U_ulLnnqC_mqNvxq`@", back))
+		goto free;
+
+	/* (5, -5), (15, 0) at precision 6 round to (1, -1), (2, 0). */
+	r = polyline_transcode(&result, &size, "IHSI", 6, 5);
+	if (assert_str_equal("rounding", "A@AA", result))
+		goto free;
+
+	r = polyline_transcode(&result, &size, "_p~iF~ps|U_ulL", 5, 6);
+	if (assert_int_equal("truncated", POLYLINE_ETRUNC, r))
+		goto free;
+	r = polyline_transcode(&result, &size, "??", 5, 16);
+	if (assert_int_equal("precision", POLYLINE_EINVAL, r))
+		goto free;
+	/* 3850000 times 10^15 does not fit. */
+	r = polyline_transcode(&result, &size, "_p~iF~ps|U", 0, 15);
+	if (assert_int_equal("overflow", POLYLINE_ERANGE, r))
+		goto free;
+	polyline_transcode(&result, &size, "_p~iF~ps|U", 5, 15);
+	r = polyline_transcode(&back, &bsize, result, 15, 5);
+	if (assert_str_equal("5 -> 15 -> 5", "_p~iF~ps|U", back))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	free(result);
+	free(back);
+}
+
+static void
+test_soa(void)
+{
+	const char *polyline = "_p~iF~ps|U_ulLnnqC_mqNvxq`@";
+	const int32_t ilat[] = {3850000, 4070000, 4325200};
+	const int32_t ilng[] = {-12020000, -12095000, -12645300};
+	float *flat = aligned_alloc(POLYLINE_SOA_ALIGN, POLYLINE_SOA_ALIGN);
+	float *flng = aligned_alloc(POLYLINE_SOA_ALIGN, POLYLINE_SOA_ALIGN);
+	double dlat[3], dlng[3];
+	int32_t rlat[3], rlng[3];
+	float *aos = NULL;
+	char *a = NULL, *b = NULL;
+	size_t asize = 0, bsize = 0, aos_size = 0;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	if (assert_int_equal("count", 3, polyline_count(polyline)))
+		goto free;
+	r = polyline_decode_soa(rlat, rlng, 3, POLYLINE_INT32, polyline);
+	if (assert_int_equal("int32 count", 3, r))
+		goto free;
+	for (int i = 0; i < 3; i++) {
+		if (assert_int_equal("int32 lat", ilat[i], rlat[i]) ||
+		    assert_int_equal("int32 lng", ilng[i], rlng[i]))
+			goto free;
+	}
+	r = polyline_decode_soa(dlat, dlng, 3, POLYLINE_DOUBLE, polyline);
+	if (assert_int_equal("double count", 3, r) ||
+	    assert_float_equal("double", 1e-9, dlng[2], -126.453))
+		goto free;
+
+	/* Same floats as the interleaved decoder. */
+	r = polyline_decode_soa(flat, flng, 3, POLYLINE_FLOAT, polyline);
+	polyline_decode(&aos, &aos_size, polyline);
+	for (int i = 0; i < r; i++) {
+		if (flat[i] != aos[i * 2] || flng[i] != aos[i * 2 + 1]) {
+			printf("ERROR: float soa %d differs\n", i);
+			goto free;
+		}
+	}
+
+	/* Same string as the interleaved encoder, for all types. */
+	polyline_encode(&a, &asize, aos, 3);
+	polyline_encode_soa(&b, &bsize, flat, flng, 3, POLYLINE_FLOAT);
+	if (assert_str_equal("encode float soa", a, b))
+		goto free;
+	polyline_encode_soa(&b, &bsize, dlat, dlng, 3, POLYLINE_DOUBLE);
+	if (assert_str_equal("encode double soa", polyline, b))
+		goto free;
+	polyline_encode_soa(&b, &bsize, ilat, ilng, 3, POLYLINE_INT32);
+	if (assert_str_equal("encode int32 soa", polyline, b))
+		goto free;
+
+	r = polyline_decode_soa(rlat, rlng, 2, POLYLINE_INT32, polyline);
+	if (assert_int_equal("too small", POLYLINE_ENOSPC, r))
+		goto free;
+	r = polyline_decode_soa(rlat, rlng, 3, 42, polyline);
+	if (assert_int_equal("bad type", POLYLINE_EINVAL, r))
+		goto free;
+	if (assert_int_equal("count truncated", POLYLINE_ETRUNC, polyline_count("??_")))
+		goto free;
+	/* Count and decode agree on the longest value and one too long. */
+	if (assert_int_equal("count 7 chunks", 1, polyline_count("______??")) ||
+	    assert_int_equal("decode 7 chunks", 1, polyline_decode_soa(rlat, rlng, 3,
+			     POLYLINE_INT32, "______??")))
+		goto free;
+	if (assert_int_equal("count 8 chunks", POLYLINE_EPARSE, polyline_count("________??")) ||
+	    assert_int_equal("decode 8 chunks", POLYLINE_EPARSE, polyline_decode_soa(rlat,
+			     rlng, 3, POLYLINE_INT32, "________??")))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	free(flat);
+	free(flng);
+	free(aos);
+	free(a);
+	free(b);
+}
+
+static void
+test_pack(void)
+{
+	const char *path = "test_pack.tmp";
+	const char *polylines[] = {
+		"_p~iF~ps|U_ulLnnqC_mqNvxq`@",
+		"??",
+		"",
+		"~po]_qo]??_c`|@~b`|@??",
+	};
+	struct polyline_pack_writer *w;
+	struct polyline_pack *pack = NULL;
+	const struct polyline_pack_entry *e;
+	float *result = NULL;
+	size_t size = 0;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	if (assert_int_equal("writer open", 0, polyline_pack_writer_open(&w, path)))
+		return;
+	for (int i = 0; i < 4; i++)
+		if (assert_int_equal("writer add", i, polyline_pack_writer_add(w, polylines[i])))
+			return;
+	if (assert_int_equal("writer add invalid", POLYLINE_ETRUNC,
+			     polyline_pack_writer_add(w, "??_")))
+		return;
+	if (assert_int_equal("writer close", 0, polyline_pack_writer_close(w)))
+		return;
+
+	if (assert_int_equal("open", 0, polyline_pack_open(&pack, path)))
+		goto free;
+	if (assert_size_t_equal("count", 4, polyline_pack_count(pack)))
+		goto free;
+	for (int i = 0; i < 4; i++)
+		if (assert_str_equal("get", polylines[i], polyline_pack_get(pack, i)))
+			goto free;
+	if (assert_ptr_equal("get out of range", NULL, polyline_pack_get(pack, 4)))
+		goto free;
+
+	e = polyline_pack_entry(pack, 0);
+	if (assert_int_equal("entry coords", 3, e->coords) ||
+	    assert_int_equal("entry min_lat", 3850000, e->min_lat) ||
+	    assert_int_equal("entry max_lat", 4325200, e->max_lat) ||
+	    assert_int_equal("entry min_lng", -12645300, e->min_lng) ||
+	    assert_int_equal("entry max_lng", -12020000, e->max_lng))
+		goto free;
+
+	r = polyline_pack_decode(pack, 3, &result, &size);
+	if (assert_int_equal("decode", 4, r) ||
+	    assert_float_equal("decode lat", 1e-5, result[0], -5.0f))
+		goto free;
+
+	if (assert_int_equal("open missing", POLYLINE_EIO,
+			     polyline_pack_open(&pack, "does/not/exist")))
+		goto free;
+	if (assert_int_equal("open no pack", POLYLINE_EPARSE,
+			     polyline_pack_open(&pack, "test.c")))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	polyline_pack_close(pack);
+	free(result);
+	unlink(path);
+}
+
+static void
+test_cache(void)
+{
+	struct polyline_cache *cache, *large = NULL;
+	struct polyline_cache_stats stats;
+	const float *coords;
+	const char *extra;
+	size_t extra_len;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	if (assert_int_equal("create", 0, polyline_cache_create(&cache, 2)))
+		return;
+	r = polyline_cache_decode(cache, "_p~iF~ps|U_ulLnnqC_mqNvxq`@", &coords, &extra, &extra_len);
+	if (assert_int_equal("miss", 3, r) ||
+	    assert_float_equal("miss coords", 1e-5, coords[5], -126.453f) ||
+	    assert_ptr_equal("no extra", NULL, extra))
+		goto free;
+	if (assert_int_equal("set extra", 0,
+			     polyline_cache_set_extra(cache, "_p~iF~ps|U_ulLnnqC_mqNvxq`@", "line\n", 5)))
+		goto free;
+	r = polyline_cache_decode(cache, "_p~iF~ps|U_ulLnnqC_mqNvxq`@", &coords, &extra, &extra_len);
+	if (assert_int_equal("hit", 3, r) ||
+	    assert_size_t_equal("hit extra", 5, extra_len) ||
+	    assert_str_equal("hit extra", "line\n", extra))
+		goto free;
+
+	/* Errors are not cached, "??" is now least recently used. */
+	polyline_cache_decode(cache, "??", &coords, NULL, NULL);
+	polyline_cache_decode(cache, "_p~iF~ps|U_ulLnnqC_mqNvxq`@", &coords, NULL, NULL);
+	r = polyline_cache_decode(cache, "??_", &coords, NULL, NULL);
+	if (assert_int_equal("error", POLYLINE_ETRUNC, r))
+		goto free;
+	polyline_cache_decode(cache, "_ibE_ibE", &coords, NULL, NULL);
+	polyline_cache_decode(cache, "_p~iF~ps|U_ulLnnqC_mqNvxq`@", &coords, NULL, NULL);
+
+	polyline_cache_stats(cache, &stats);
+	if (assert_size_t_equal("hits", 3, stats.hits) ||
+	    assert_size_t_equal("misses", 4, stats.misses) ||
+	    assert_size_t_equal("evictions", 1, stats.evictions) ||
+	    assert_size_t_equal("entries", 2, stats.entries))
+		goto free;
+	if (assert_int_equal("evicted", POLYLINE_EINVAL,
+			     polyline_cache_set_extra(cache, "??", "x", 1)))
+		goto free;
+	if (assert_int_equal("capacity too large", POLYLINE_EINVAL,
+			     polyline_cache_create(&large, SIZE_MAX / 2 + 1)))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	polyline_cache_destroy(cache);
+}
+
+static void
+test_similarity(void)
+{
+	/* (38.5, -120.2), (40.7, -120.95), (43.252, -126.453) */
+	const char *a = "_p~iF~ps|U_ulLnnqC_mqNvxq`@";
+	/* The first two points of a. */
+	const char *b = "_p~iF~ps|U_ulLnnqC";
+	/* a shifted by 0.00001 in latitude. */
+	const char *c = "ap~iF~ps|U_ulLnnqC_mqNvxq`@";
+	/* From the last point of a to the last point of b. */
+	const double far = sqrt(2.552 * 2.552 + 5.503 * 5.503);
+	double dist;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	r = polyline_hausdorff(&dist, a, a, INFINITY);
+	if (assert_int_equal("hausdorff same", 0, r) ||
+	    assert_float_equal("hausdorff same", 1e-9, dist, 0))
+		return;
+	r = polyline_hausdorff(&dist, a, b, INFINITY);
+	if (assert_int_equal("hausdorff", 0, r) ||
+	    assert_float_equal("hausdorff", 1e-5, dist, far))
+		return;
+	r = polyline_hausdorff(&dist, b, a, 1.0);
+	if (assert_int_equal("hausdorff early exit", 1, r) ||
+	    assert_int_equal("hausdorff lower bound", 1, dist > 1.0))
+		return;
+	r = polyline_hausdorff(&dist, a, c, INFINITY);
+	if (assert_float_equal("hausdorff shifted", 1e-7, dist, 0.00001))
+		return;
+
+	r = polyline_frechet(&dist, a, b, INFINITY);
+	if (assert_int_equal("frechet", 0, r) ||
+	    assert_float_equal("frechet", 1e-5, dist, far))
+		return;
+	r = polyline_frechet(&dist, a, c, INFINITY);
+	if (assert_float_equal("frechet shifted", 1e-7, dist, 0.00001))
+		return;
+	/* The walk over the reversed polyline starts 5.6 degrees off. */
+	r = polyline_frechet(&dist, a, "_mqNvxq`@_ulLnnqC_p~iF~ps|U", 1.0);
+	if (assert_int_equal("frechet early exit", 1, r))
+		return;
+
+	if (assert_int_equal("prefix", 2, polyline_shared_prefix(a, b, 0)) ||
+	    assert_int_equal("prefix same", 3, polyline_shared_prefix(a, a, 0)) ||
+	    assert_int_equal("prefix shifted", 0, polyline_shared_prefix(a, c, 0)) ||
+	    assert_int_equal("prefix tolerance", 3, polyline_shared_prefix(a, c, 0.00002)))
+		return;
+
+	if (assert_int_equal("empty", POLYLINE_EINVAL, polyline_hausdorff(&dist, a, "", 1)) ||
+	    assert_int_equal("truncated", POLYLINE_ETRUNC, polyline_frechet(&dist, a, "_p~iF", 1)))
+		return;
+	if (assert_int_equal("hausdorff negative", POLYLINE_EINVAL,
+			     polyline_hausdorff(&dist, a, b, -1)) ||
+	    assert_int_equal("hausdorff nan", POLYLINE_EINVAL,
+			     polyline_hausdorff(&dist, a, b, NAN)) ||
+	    assert_int_equal("frechet negative", POLYLINE_EINVAL,
+			     polyline_frechet(&dist, a, b, -1)) ||
+	    assert_int_equal("frechet nan", POLYLINE_EINVAL,
+			     polyline_frechet(&dist, a, b, NAN)) ||
+	    assert_int_equal("prefix nan", POLYLINE_EINVAL,
+			     polyline_shared_prefix(a, b, NAN)))
+		return;
+	/* A value longer than the decoder takes, in either polyline. */
+	dist = -1;
+	if (assert_int_equal("frechet long a", POLYLINE_EPARSE,
+			     polyline_frechet(&dist, "________??", b, INFINITY)) ||
+	    assert_int_equal("frechet long b", POLYLINE_EPARSE,
+			     polyline_frechet(&dist, a, "________??", INFINITY)) ||
+	    assert_float_equal("frechet dist untouched", 1e-9, dist, -1))
+		return;
+
+	printf("GOOD\n");
+}
+
+struct clip_runs {
+	int runs;
+	int stop_after;
+	char polylines[4][64];
+};
+
+static int
+clip_collect(const char *polyline, size_t len, void *ctx)
+{
+	struct clip_runs *c = ctx;
+	if (c->runs < 4 && len < sizeof(c->polylines[0]))
+		strcpy(c->polylines[c->runs], polyline);
+	c->runs++;
+	return c->runs == c->stop_after;
+}
+
+static void
+test_clip(void)
+{
+	/* Along the equator from 0 to 20 and back to 10, in 1e-5 degrees. */
+	const float coords[] = {0, 0, 0, 0.0001f, 0, 0.0002f, 0, 0.0001f};
+	const struct polyline_bbox bbox = {-1, 5, 1, 15};
+	const struct polyline_bbox outside = {100, 100, 200, 200};
+	struct clip_runs c = {0};
+	char *polyline = NULL, *expected = NULL;
+	size_t size = 0, esize = 0;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	polyline_encode(&polyline, &size, coords, 4);
+	r = polyline_clip(polyline, &bbox, clip_collect, &c);
+	if (assert_int_equal("runs", 2, r) || assert_int_equal("callbacks", 2, c.runs))
+		goto free;
+	/* In at 5, out at 15, in again at 15 until the end at 10. */
+	const float run0[] = {0, 0.00005f, 0, 0.0001f, 0, 0.00015f};
+	const float run1[] = {0, 0.00015f, 0, 0.0001f};
+	polyline_encode(&expected, &esize, run0, 3);
+	if (assert_str_equal("run 0", expected, c.polylines[0]))
+		goto free;
+	polyline_encode(&expected, &esize, run1, 2);
+	if (assert_str_equal("run 1", expected, c.polylines[1]))
+		goto free;
+
+	c = (struct clip_runs){.stop_after = 1};
+	r = polyline_clip(polyline, &bbox, clip_collect, &c);
+	if (assert_int_equal("stop", 1, r))
+		goto free;
+	c = (struct clip_runs){0};
+	r = polyline_clip(polyline, &outside, clip_collect, &c);
+	if (assert_int_equal("outside", 0, r) || assert_int_equal("outside callbacks", 0, c.runs))
+		goto free;
+
+	/* A single point inside is kept. */
+	c = (struct clip_runs){0};
+	r = polyline_clip("??", &bbox, clip_collect, &c);
+	if (assert_int_equal("single point", 0, r))
+		goto free;
+	r = polyline_clip("??", &(struct polyline_bbox){-1, -1, 1, 1}, clip_collect, &c);
+	if (assert_int_equal("single point inside", 1, r) ||
+	    assert_str_equal("single point inside", "??", c.polylines[0]))
+		goto free;
+
+	r = polyline_clip("_p~iF~ps|U_ulL", &bbox, clip_collect, &c);
+	if (assert_int_equal("truncated", POLYLINE_ETRUNC, r))
+		goto free;
+	c = (struct clip_runs){0};
+	r = polyline_clip("??________??", &(struct polyline_bbox){-1, -1, 1, 1},
+			  clip_collect, &c);
+	if (assert_int_equal("value too long", POLYLINE_EPARSE, r) ||
+	    assert_int_equal("nothing emitted", 0, c.runs))
+		goto free;
+	r = polyline_clip(polyline, &(struct polyline_bbox){1, 0, 0, 0}, clip_collect, &c);
+	if (assert_int_equal("bbox", POLYLINE_EINVAL, r))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	free(polyline);
+	free(expected);
+}
+
+static void
+test_route(void)
+{
+	struct polyline_route *route = NULL;
+	struct polyline_route_match m, scan;
+	const size_t n = 5000;
+	float *coords = malloc(n * 2 * sizeof(*coords));
+	double *lat = malloc(n * sizeof(*lat)), *lng = malloc(n * sizeof(*lng));
+	char *polyline = NULL;
+	size_t size = 0;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	/* East along the equator for 0.01 degrees, then north. */
+	r = polyline_route_create(&route, "???o}@o}@?");
+	if (assert_int_equal("create", 0, r) ||
+	    assert_size_t_equal("points", 3, polyline_route_points(route)))
+		goto free;
+	/* 0.01 degrees are 1111.95 m on the equator. */
+	if (assert_float_equal("length", 0.1, polyline_route_length(route), 2 * 1111.951))
+		goto free;
+	r = polyline_route_nearest(route, 0.001, 0.005, &m);
+	if (assert_int_equal("nearest", 0, r) ||
+	    assert_size_t_equal("segment", 0, m.segment) ||
+	    assert_float_equal("fraction", 1e-6, m.fraction, 0.5) ||
+	    assert_float_equal("lat", 1e-9, m.lat, 0) ||
+	    assert_float_equal("lng", 1e-9, m.lng, 0.005) ||
+	    assert_float_equal("distance", 0.1, m.distance, 111.195) ||
+	    assert_float_equal("along", 0.1, m.along, 555.975))
+		goto free;
+	r = polyline_route_nearest(route, 0.02, 0.012, &m);
+	if (assert_size_t_equal("past the end", 1, m.segment) ||
+	    assert_float_equal("past the end", 1e-6, m.fraction, 1.0))
+		goto free;
+	polyline_route_destroy(route);
+	route = NULL;
+
+	/* A winding route, checked against a linear scan. */
+	for (size_t i = 0; i < n; i++) {
+		coords[i * 2] = 52.5f + 0.01f * sinf(i * 0.01f) + 0.00001f * (i % 7);
+		coords[i * 2 + 1] = 13.4f + 0.00002f * i;
+	}
+	polyline_encode(&polyline, &size, coords, n);
+	if (assert_int_equal("create", 0, polyline_route_create(&route, polyline)))
+		goto free;
+	polyline_decode_soa(lat, lng, n, POLYLINE_DOUBLE, polyline);
+	/* Same projection as the route: around the middle latitude. */
+	double min_lat = INFINITY, max_lat = -INFINITY;
+	for (size_t i = 0; i < n; i++) {
+		min_lat = fmin(min_lat, lat[i]);
+		max_lat = fmax(max_lat, lat[i]);
+	}
+	const double ky = 6371008.8 * M_PI / 180;
+	const double kx = ky * cos((min_lat + max_lat) / 2 * M_PI / 180);
+	for (int q = 0; q < 50; q++) {
+		double px = (13.39 + 0.0025 * q) * kx, py = (52.48 + 0.0008 * q) * ky;
+		polyline_route_nearest(route, py / ky, px / kx, &m);
+		scan.distance = INFINITY;
+		scan.segment = 0;
+		for (size_t i = 0; i + 1 < n; i++) {
+			double ax = lng[i] * kx, ay = lat[i] * ky;
+			double dx = lng[i + 1] * kx - ax, dy = lat[i + 1] * ky - ay;
+			double t = ((px - ax) * dx + (py - ay) * dy) / (dx * dx + dy * dy);
+			t = t < 0 ? 0 : t > 1 ? 1 : t;
+			double d = hypot(px - ax - t * dx, py - ay - t * dy);
+			if (d < scan.distance) {
+				scan.distance = d;
+				scan.segment = i;
+			}
+		}
+		if (assert_float_equal("scan distance", 0.01, m.distance, scan.distance) ||
+		    assert_size_t_equal("scan segment", scan.segment, m.segment))
+			goto free;
+	}
+	polyline_route_destroy(route);
+	route = NULL;
+
+	r = polyline_route_create(&route, "");
+	if (assert_int_equal("empty", POLYLINE_EINVAL, r))
+		goto free;
+	r = polyline_route_create(&route, "???o}@o}@");
+	if (assert_int_equal("truncated", POLYLINE_ETRUNC, r))
+		goto free;
+	r = polyline_route_create(&route, "??________??");
+	if (assert_int_equal("value too long", POLYLINE_EPARSE, r) ||
+	    assert_int_equal("no route", 1, route == NULL))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	polyline_route_destroy(route);
+	free(coords);
+	free(lat);
+	free(lng);
+	free(polyline);
+}
+
+static void
+test_store(void)
+{
+	struct polyline_store *store = NULL;
+	struct polyline_store_stats stats, before;
+	const size_t n = 2000, routes = 20;
+	float *coords = malloc(n * 2 * sizeof(*coords));
+	char *polylines[20] = {NULL}, *result = NULL, *bad = NULL;
+	size_t sizes[20] = {0}, size = 0, bad_size = 0;
+	int r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	if (assert_int_equal("create", 0, polyline_store_create(&store)))
+		goto free;
+	/* All routes share a prefix and a suffix, with their own middle. */
+	for (size_t k = 0; k < routes; k++) {
+		for (size_t i = 0; i < n; i++) {
+			float detour = (i > 800 && i < 1200) ? 0.001f * (k + 1) : 0;
+			coords[i * 2] = 48.1f + 0.0001f * i + detour;
+			coords[i * 2 + 1] = 11.5f + 0.001f * sinf(i * 0.05f);
+		}
+		polyline_encode(&polylines[k], &sizes[k], coords, n);
+		r = polyline_store_add(store, polylines[k]);
+		if (assert_int_equal("add", k, r))
+			goto free;
+	}
+	r = polyline_store_add(store, "_p~iF~ps|U_ulL");
+	if (assert_int_equal("truncated", POLYLINE_ETRUNC, r) ||
+	    assert_int_equal("after error", routes, polyline_store_add(store, "")) ||
+	    assert_size_t_equal("count", routes + 1, polyline_store_count(store)))
+		goto free;
+
+	/* Runs added before a parse error are rolled back. */
+	polyline_store_stats(store, &before);
+	for (size_t i = 0; i < n; i++)
+		coords[i * 2] += 1.0f;
+	polyline_encode(&bad, &bad_size, coords, n);
+	bad = realloc(bad, strlen(bad) + 16);
+	strcat(bad, "________??");
+	r = polyline_store_add(store, bad);
+	polyline_store_stats(store, &stats);
+	if (assert_int_equal("value too long", POLYLINE_EPARSE, r) ||
+	    assert_size_t_equal("runs rolled back", before.runs, stats.runs) ||
+	    assert_size_t_equal("refs rolled back", before.run_refs, stats.run_refs) ||
+	    assert_size_t_equal("bytes rolled back", before.stored_bytes, stats.stored_bytes))
+		goto free;
+
+	for (size_t k = 0; k < routes; k++) {
+		r = polyline_store_get(store, k, &result, &size);
+		if (assert_int_equal("get", strlen(polylines[k]), r) ||
+		    assert_str_equal("get", polylines[k], result))
+			goto free;
+	}
+	r = polyline_store_get(store, routes, &result, &size);
+	if (assert_int_equal("empty", 0, r) || assert_str_equal("empty", "", result))
+		goto free;
+	r = polyline_store_get(store, routes + 1, &result, &size);
+	if (assert_int_equal("id", POLYLINE_EINVAL, r))
+		goto free;
+
+	polyline_store_stats(store, &stats);
+	if (assert_size_t_equal("polylines", routes + 1, stats.polylines) ||
+	    assert_size_t_gt("shared runs", stats.runs, stats.run_refs) ||
+	    assert_size_t_gt("savings", stats.stored_bytes * 2, stats.input_bytes))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	polyline_store_destroy(store);
+	for (size_t k = 0; k < routes; k++)
+		free(polylines[k]);
+	free(coords);
+	free(result);
+	free(bad);
+}
+
+static void
+test_dod(void)
+{
+	/* A 1 Hz trace at 20 to 40 m/s, slowly speeding up to the north east. */
+	const size_t n = 600;
+	float *coords = malloc(n * 2 * sizeof(*coords));
+	float *result = NULL, *expected = NULL;
+	char *polyline = NULL, *dod = NULL, *back = NULL;
+	size_t psize = 0, dsize = 0, bsize = 0, rsize = 0, esize = 0;
+	int r, len;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	for (size_t i = 0; i < n; i++) {
+		coords[i * 2] = round(5252000 + 18.0 * i + 0.01 * i * i) / 1e5;
+		coords[i * 2 + 1] = round(1340000 + 30.0 * i + 0.005 * i * i) / 1e5;
+	}
+	len = polyline_encode(&polyline, &psize, coords, n);
+	r = polyline_encode_dod(&dod, &dsize, coords, n);
+	if (assert_int_equal("header", 'A', dod[0]) ||
+	    assert_size_t_gt("about half the size", r * 100, len * 55))
+		goto free;
+
+	r = polyline_dod_to_polyline(&back, &bsize, dod);
+	if (assert_int_equal("to polyline", len, r) ||
+	    assert_str_equal("to polyline", polyline, back))
+		goto free;
+	r = polyline_dod_from_polyline(&back, &bsize, polyline);
+	if (assert_str_equal("from polyline", dod, back))
+		goto free;
+
+	r = polyline_decode_dod(&result, &rsize, dod);
+	polyline_decode(&expected, &esize, polyline);
+	if (assert_int_equal("decode", n, r) ||
+	    assert_int_equal("decode", 0, memcmp(expected, result, n * 2 * sizeof(float))))
+		goto free;
+
+	r = polyline_decode_dod(&result, &rsize, "A");
+	if (assert_int_equal("empty", 0, r))
+		goto free;
+	r = polyline_decode_dod(&result, &rsize, "_p~iF~ps|U");
+	if (assert_int_equal("no header", POLYLINE_EPARSE, r))
+		goto free;
+	r = polyline_dod_to_polyline(&back, &bsize, "A_p~iF~ps|U_ulL");
+	if (assert_int_equal("truncated", POLYLINE_ETRUNC, r))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	free(coords);
+	free(result);
+	free(expected);
+	free(polyline);
+	free(dod);
+	free(back);
+}
+
+static void
+test_ctx(void)
+{
+	const float google[] = {38.5f, -120.2f, 40.7f, -120.95f, 43.252f, -126.453f};
+	struct polyline_ctx *ctx = NULL;
+	const size_t n = 5000;
+	float *coords = malloc(n * 2 * sizeof(*coords));
+	float *expected = NULL;
+	char *polyline = NULL;
+	size_t psize = 0, esize = 0;
+	const char *result;
+	const float *decoded;
+	ssize_t r;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	if (assert_int_equal("create", 0, polyline_ctx_create(&ctx)))
+		goto free;
+	r = polyline_ctx_encode(ctx, google, 3, &result);
+	if (assert_int_equal("small encode", 27, r) ||
+	    assert_str_equal("small encode", "_p~iF~ps|U_ulLnnqC_mqNxxq`@", result))
+		goto free;
+	r = polyline_ctx_decode(ctx, result, &decoded);
+	if (assert_int_equal("small decode", 3, r) ||
+	    assert_float_equal("small decode", max_delta, decoded[5], -126.453f))
+		goto free;
+
+	/* Larger inputs move the buffers to the heap, smaller ones still work. */
+	for (size_t i = 0; i < n * 2; i++)
+		coords[i] = (float)((i * 7919) % 18000) / 100 - 90;
+	for (int round = 0; round < 2; round++) {
+		r = polyline_ctx_encode(ctx, coords, round ? 3 : n, &result);
+		polyline_encode(&polyline, &psize, coords, round ? 3 : n);
+		if (assert_int_equal("encode", strlen(polyline), r) ||
+		    assert_str_equal("encode", polyline, result))
+			goto free;
+		r = polyline_ctx_decode(ctx, result, &decoded);
+		polyline_decode(&expected, &esize, polyline);
+		if (assert_int_equal("decode", round ? 3 : n, r) ||
+		    assert_int_equal("decode", 0, memcmp(expected, decoded, r * 2 * sizeof(float))))
+			goto free;
+	}
+
+	if (assert_int_equal("truncated", POLYLINE_ETRUNC,
+			     polyline_ctx_decode(ctx, "_p~iF~ps|U_ulL", &decoded)) ||
+	    assert_int_equal("empty", POLYLINE_EINVAL,
+			     polyline_ctx_encode(ctx, coords, 0, &result)))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	polyline_ctx_destroy(ctx);
+	free(coords);
+	free(expected);
+	free(polyline);
+}
+
+static int
+serve_recv(int fd, void *data, size_t len)
+{
+	for (size_t off = 0; off < len; ) {
+		ssize_t r = recv(fd, (char *)data + off, len - off, 0);
+		if (r <= 0)
+			return -1;
+		off += r;
+	}
+	return 0;
+}
+
+static void
+test_serve(void)
+{
+	const char *path = "test_serve.sock";
+	const char *polyline = "_p~iF~ps|U_ulLnnqC_mqNxxq`@";
+	const float google[] = {38.5f, -120.2f, 40.7f, -120.95f, 43.252f, -126.453f};
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+	struct serve_frame req, resp;
+	char buf[256], *p = buf;
+	float coords[6];
+	int fd = -1;
+	pid_t pid;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+	fflush(stdout);
+
+	strcpy(addr.sun_path, path);
+	if ((pid = fork()) < 0) {
+		printf("ERROR: fork failed\n");
+		return;
+	}
+	if (!pid) {
+		freopen("/dev/null", "w", stderr);
+		_exit(serve(path));
+	}
+
+	/* Wait for the server to listen. */
+	for (int i = 0; i < 500; i++) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			break;
+		if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+			break;
+		close(fd);
+		fd = -1;
+		usleep(10000);
+	}
+	if (assert_int_equal("connect", 1, fd >= 0))
+		goto free;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	/* Two pipelined requests in one write. */
+	req = (struct serve_frame){sizeof(google), SERVE_OP_ENCODE};
+	memcpy(p, &req, sizeof(req));
+	memcpy(p += sizeof(req), google, sizeof(google));
+	req = (struct serve_frame){strlen(polyline), SERVE_OP_DECODE};
+	memcpy(p += sizeof(google), &req, sizeof(req));
+	memcpy(p += sizeof(req), polyline, strlen(polyline));
+	p += strlen(polyline);
+	if (assert_int_equal("send", p - buf, send(fd, buf, p - buf, MSG_NOSIGNAL)))
+		goto free;
+
+	if (assert_int_equal("encode recv", 0, serve_recv(fd, &resp, sizeof(resp))) ||
+	    assert_int_equal("encode code", strlen(polyline), resp.code) ||
+	    assert_int_equal("encode length", strlen(polyline), resp.length) ||
+	    assert_int_equal("encode recv", 0, serve_recv(fd, buf, resp.length)))
+		goto free;
+	buf[resp.length] = '\0';
+	if (assert_str_equal("encode", polyline, buf))
+		goto free;
+
+	if (assert_int_equal("decode recv", 0, serve_recv(fd, &resp, sizeof(resp))) ||
+	    assert_int_equal("decode code", 3, resp.code) ||
+	    assert_int_equal("decode length", sizeof(coords), resp.length) ||
+	    assert_int_equal("decode recv", 0, serve_recv(fd, coords, sizeof(coords))))
+		goto free;
+	for (int i = 0; i < 6; i++)
+		if (assert_float_equal("decode", max_delta, coords[i], google[i]))
+			goto free;
+
+	/* Frames over the limit close the connection. */
+	req = (struct serve_frame){SERVE_MAX_FRAME + 1, SERVE_OP_DECODE};
+	if (assert_int_equal("send large", sizeof(req), send(fd, &req, sizeof(req), MSG_NOSIGNAL)) ||
+	    assert_int_equal("closed", 0, recv(fd, buf, sizeof(buf), 0)))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	if (fd >= 0)
+		close(fd);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+}
+
+static int trace_counts[POLYLINE_TRACE_ERROR + 1];
+static int64_t trace_last_error;
+static int64_t trace_last_grow;
+
+static void
+trace_count(const struct polyline_trace_event *ev, void *ctx)
+{
+	(void)ctx;
+	trace_counts[ev->point]++;
+	if (ev->point == POLYLINE_TRACE_ERROR)
+		trace_last_error = ev->arg;
+	if (ev->point == POLYLINE_TRACE_GROW)
+		trace_last_grow = ev->arg;
+}
+
+static void
+test_trace(void)
+{
+	struct polyline_ctx *ctx = NULL;
+	const char *cencoded;
+	const float *cdecoded;
+	float *result = NULL;
+	char *encoded = NULL;
+	size_t size = 0, esize = 0;
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+
+	if (polyline_set_trace(trace_count, NULL) == POLYLINE_EINVAL) {
+		/* Compiled without -DPOLYLINE_TRACE */
+		printf("GOOD\n");
+		return;
+	}
+	polyline_decode(&result, &size, "_p~iF~ps|U_ulLnnqC_mqNvxq`@");
+	polyline_decode(&result, &size, "??_");
+	polyline_set_trace(NULL, NULL);
+	polyline_decode(&result, &size, "??");
+
+	if (assert_int_equal("decode start", 2, trace_counts[POLYLINE_TRACE_DECODE_START]) ||
+	    assert_int_equal("decode end", 1, trace_counts[POLYLINE_TRACE_DECODE_END]) ||
+	    assert_int_equal("grow", 1, trace_counts[POLYLINE_TRACE_GROW]) ||
+	    assert_int_equal("error", 1, trace_counts[POLYLINE_TRACE_ERROR]) ||
+	    assert_int_equal("error code", POLYLINE_ETRUNC, trace_last_error))
+		goto free;
+
+	/* Invalid arguments start an event pair as well. */
+	memset(trace_counts, 0, sizeof(trace_counts));
+	polyline_set_trace(trace_count, NULL);
+	polyline_decode(&result, &size, NULL);
+	polyline_encode(&encoded, &esize, NULL, 0);
+	if (assert_int_equal("invalid decode start", 1, trace_counts[POLYLINE_TRACE_DECODE_START]) ||
+	    assert_int_equal("invalid encode start", 1, trace_counts[POLYLINE_TRACE_ENCODE_START]) ||
+	    assert_int_equal("invalid errors", 2, trace_counts[POLYLINE_TRACE_ERROR]))
+		goto free;
+
+	/* Growth is reported in bytes for both directions. */
+	free(result);
+	result = NULL;
+	size = 0;
+	polyline_decode(&result, &size, "_p~iF~ps|U_ulLnnqC_mqNvxq`@");
+	if (assert_size_t_equal("decode grow bytes", size * sizeof(float), trace_last_grow))
+		goto free;
+	polyline_encode(&encoded, &esize, result, 3);
+	if (assert_size_t_equal("encode grow bytes", esize * sizeof(float), trace_last_grow))
+		goto free;
+
+	/* Contexts have the same trace points. */
+	memset(trace_counts, 0, sizeof(trace_counts));
+	if (polyline_ctx_create(&ctx))
+		goto free;
+	polyline_ctx_encode(ctx, result, 3, &cencoded);
+	polyline_ctx_decode(ctx, "??_", &cdecoded);
+	if (assert_int_equal("ctx encode start", 1, trace_counts[POLYLINE_TRACE_ENCODE_START]) ||
+	    assert_int_equal("ctx encode end", 1, trace_counts[POLYLINE_TRACE_ENCODE_END]) ||
+	    assert_int_equal("ctx decode start", 1, trace_counts[POLYLINE_TRACE_DECODE_START]) ||
+	    assert_int_equal("ctx error", 1, trace_counts[POLYLINE_TRACE_ERROR]))
+		goto free;
+
+	printf("GOOD\n");
+free:
+	polyline_set_trace(NULL, NULL);
+	polyline_ctx_destroy(ctx);
+	free(result);
+	free(encoded);
+}
+
 int
 main()
 {
@@ -422,5 +1459,22 @@ main()
 
 	test_strerror();
 
+	test_nd_roundtrip();
+	test_nd_errors();
+
+	test_decode_parallel();
+	test_transcode();
+	test_soa();
+	test_pack();
+	test_cache();
+	test_trace();
+	test_similarity();
+	test_clip();
+	test_route();
+	test_store();
+	test_dod();
+	test_ctx();
+	test_serve();
+
 	return 0;
 }
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "polyline.hpp"
+
+static int test_name_indent = 50;
+
+static constexpr polyline::point<double> google_polyline_data[] = {
+	{38.5, -120.2},
+	{40.7, -120.95},
+	{43.252, -126.453},
+};
+
+/* Compile time encoding of the reference example. */
+static constexpr auto google_polyline = polyline::encode_literal(google_polyline_data);
+static_assert(google_polyline.str() == "_p~iF~ps|U_ulLnnqC_mqNvxq`@", "constexpr encode");
+static_assert(polyline::view<>("_p~iF~ps|U_ulLnnqC_mqNvxq`@").size() == 3, "constexpr size");
+static_assert(polyline::view<>("_p~iF~ps|U?").validate() == POLYLINE_ETRUNC, "constexpr validate");
+
+static void
+test_view_iterate(void)
+{
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+	polyline::view<5, double> v("_p~iF~ps|U_ulLnnqC_mqNvxq`@");
+	size_t i = 0;
+	for (const auto &p : v) {
+		if (std::fabs(p.lat - google_polyline_data[i].lat) > 1e-9 ||
+		    std::fabs(p.lng - google_polyline_data[i].lng) > 1e-9) {
+			printf("ERROR: point %zu (%f, %f)\n", i, p.lat, p.lng);
+			return;
+		}
+		i++;
+	}
+	if (i != 3 || std::distance(v.begin(), v.end()) != 3) {
+		printf("ERROR: wrong number of points %zu\n", i);
+		return;
+	}
+
+	/* Works with standard algorithms. */
+	auto south = std::max_element(v.begin(), v.end(),
+		[](const auto &a, const auto &b) { return a.lng > b.lng; });
+	if (south->lng != -126.453) {
+		printf("ERROR: max_element %f\n", south->lng);
+		return;
+	}
+	printf("GOOD\n");
+}
+
+static void
+test_view_invalid(void)
+{
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+	/* Iteration stops at the malformed coordinate. */
+	polyline::view<> v("??__");
+	if (std::distance(v.begin(), v.end()) != 1) {
+		printf("ERROR: expected one point\n");
+		return;
+	}
+	if (v.validate() != POLYLINE_ETRUNC || polyline::view<>("?\x01").validate() != POLYLINE_EPARSE) {
+		printf("ERROR: validate\n");
+		return;
+	}
+	/* Same limit of 7 characters per value as polyline_decode(). */
+	polyline::view<> too_long("________??");
+	if (polyline::view<>("______??").validate() ||
+	    too_long.validate() != POLYLINE_EPARSE ||
+	    std::distance(too_long.begin(), too_long.end()) != 0) {
+		printf("ERROR: value length limit\n");
+		return;
+	}
+	if (polyline::view<>("").begin() != polyline::view<>("").end()) {
+		printf("ERROR: empty view\n");
+		return;
+	}
+	printf("GOOD\n");
+}
+
+static void
+test_encode_precision6(void)
+{
+	printf("Running %-*s", test_name_indent, __FUNCTION__);
+	std::vector<polyline::point<double>> pts(std::begin(google_polyline_data),
+						 std::end(google_polyline_data));
+	std::string s = "prefix:";
+	polyline::encode<6>(pts, s);
+	polyline::view<6, double> v(std::string_view(s).substr(7));
+	if (v.validate() || !std::equal(v.begin(), v.end(), pts.begin(),
+			[](const auto &a, const auto &b) {
+				return std::fabs(a.lat - b.lat) < 1e-9 && std::fabs(a.lng - b.lng) < 1e-9;
+			})) {
+		printf("ERROR: precision 6 roundtrip '%s'\n", s.c_str());
+		return;
+	}
+
+	/* Same output as the C encoder for data without float drift. */
+	const float data[] = {0.0f, 0.0f, 1.0f, 1.0f, 2.0f, 2.0f};
+	char *cptr = NULL;
+	size_t csize = 0;
+	polyline_encode(&cptr, &csize, data, 3);
+	const polyline::point<float> fpts[] = {{0.0f, 0.0f}, {1.0f, 1.0f}, {2.0f, 2.0f}};
+	std::string fs = polyline::encode(fpts);
+	int diff = strcmp(cptr, fs.c_str());
+	if (diff) {
+		printf("ERROR: C and C++ encoders disagree: '%s'\n", fs.c_str());
+		free(cptr);
+		return;
+	}
+
+	/*
+	 * They differ where the float delta rounds differently from the
+	 * absolute positions: -126.453f - -120.95f is -5.50300598.
+	 */
+	const float gdata[] = {38.5f, -120.2f, 40.7f, -120.95f, 43.252f, -126.453f};
+	const polyline::point<float> gpts[] = {{38.5f, -120.2f}, {40.7f, -120.95f}, {43.252f, -126.453f}};
+	polyline_encode(&cptr, &csize, gdata, 3);
+	fs = polyline::encode(gpts);
+	diff = strcmp(cptr, "_p~iF~ps|U_ulLnnqC_mqNxxq`@") ||
+	       fs != "_p~iF~ps|U_ulLnnqC_mqNvxq`@";
+	if (diff)
+		printf("ERROR: encoders '%s' and '%s'\n", cptr, fs.c_str());
+	free(cptr);
+	if (diff)
+		return;
+	printf("GOOD\n");
+}
+
+int
+main()
+{
+	test_view_iterate();
+	test_view_invalid();
+	test_encode_precision6();
+	return 0;
+}